@@ -40,11 +40,37 @@ void usage(const char *proggie)
     std::cerr << "      -m <int>   number of streams per measurement (default: 1)" << std::endl;
     std::cerr << "      -r <float> set convergence resolution (default: 500.0 kb/s)" << std::endl;
     std::cerr << "      -s <int>   mean inter-stream spacing (default: 50 milliseconds)" << std::endl;
+    std::cerr << "      -u         run the pacing thread at real-time priority with memory locked" << std::endl;
+    std::cerr << "      -A <int>   pin the pacing thread to this cpu" << std::endl;
+    std::cerr << "      -T <int>   pacing threads per stream, pinned to consecutive cpus (default: 1; max: " << PACER_MAX_LANES << ")" << std::endl;
+    std::cerr << "      -L <int>   receiver report: 0 summary, 1 with loss bitmap, 2 with per-probe stamps, 3 with one-way delays (default: 3)" << std::endl;
+    std::cerr << "      -G         high-rate mode: send streams as UDP_SEGMENT trains (min spacing " << MIN_SPACE_GSO << ")" << std::endl;
+    std::cerr << "      -E <int>   probe transmit: 0 udp socket, 1 PACKET_TX_RING, 2 PACKET_TX_RING bypassing qdisc, 3 AF_XDP (default: 0)" << std::endl;
+    std::cerr << "      -w <int>   untimed warmup probes sent just ahead of each stream (default: 0; max: " << YAZMAXWARMUP << ")" << std::endl;
+    std::cerr << "      -q         hold a zero cpu latency request (" << YAZPMQOSDEV << ") while each stream is sent" << std::endl;
+    std::cerr << "      -a <int>   max back-off of estimation interval on a stable path (default: " << MAX_BACKOFF << "; 1 disables)" << std::endl;
+
+    std::cerr << "   if receiver (-R):" << std::endl;
+    std::cerr << "      -N <int>   number of receive shards, one thread and probe socket per cpu (default: 1)" << std::endl;
+    std::cerr << "      -G         accept coalesced probes (UDP_GRO) for high-rate senders" << std::endl;
+    std::cerr << "      -B <int>   busy-poll probe sockets (usecs) while a stream is expected, block between streams (default: always spin)" << std::endl;
+#if HAVE_AF_XDP
+    std::cerr << "      -X <str>   capture probes with AF_XDP on this interface (no default)" << std::endl;
+#endif
+#if HAVE_PROBE_TAP
+    std::cerr << "      -K <str>   record probes in the kernel (xdp + bpf ring buffer) on this interface (no default)" << std::endl;
+    std::cerr << "      -D         with -K, drop probes in the kernel once recorded" << std::endl;
+#endif
 
     std::cerr << "   for both sender and receiver:" << std::endl;
     std::cerr << "      -p <port>  specify control port (" << DEST_CTRL_PORT << ")" << std::endl;
     std::cerr << "      -P <port>  specify probe port (" << DEST_PORT << ")" << std::endl;
     std::cerr << "      -v         increase verbosity" << std::endl;
+    std::cerr << "      -k <int>   re-measure timing overheads every n streams (default: " << YAZRECALINTERVAL << "; 0 disables)" << std::endl;
+#if HAVE_IO_URING
+    std::cerr << "      -I         use the io_uring I/O engine (kernel-paced probe sends, multishot probe receives)" << std::endl;
+#endif
+    std::cerr << "      -C <file>  timing calibration cache (default: ~/" << YAZCALIBFILE << "; empty to disable)" << std::endl;
 #if HAVE_PCAP_H
     std::cerr << "      -x <str>   pcap interface name (no default)" << std::endl;
 #endif
@@ -69,27 +95,79 @@ int main(int argc, char **argv)
     int inter_stream_spacing = 50000;
     int verbose = 0;
     float resolution = 500000.0;
+    int max_backoff = MAX_BACKOFF;
 #if HAVE_PCAP_H
     std::string pcap_dev = "";
 #endif
     bool sched_up = false;
+    int pacer_cpu = -1;
+    int recal_interval = YAZRECALINTERVAL;
+    int nshards = 1;
+    int busy_poll = 0;
+    int report_level = PREPORT_DELAYS;
+    bool high_rate = false;
+    int nlanes = 1;
+    int tx_mode = PTX_SOCKET;
+    bool uring = false;
+    int warmup = 0;
+    bool pm_qos = false;
+#if HAVE_AF_XDP
+    std::string xdp_dev = "";
+#endif
+#if HAVE_PROBE_TAP
+    std::string tap_dev = "";
+    bool tap_drop = false;
+#endif
+    std::string calib_file = "";
+    if (getenv("HOME"))
+        calib_file = std::string(getenv("HOME")) + "/" + YAZCALIBFILE;
 
-    while ((c = getopt(argc, argv, "c:i:l:m:n:p:P:RS:r:s:vux:")) != EOF)
+    while ((c = getopt(argc, argv, "A:a:B:C:c:DE:GIi:K:k:L:l:m:N:n:p:P:qRS:r:s:T:vuw:X:x:")) != EOF)
     {
         switch(c)
         {
+        case 'A':
+            pacer_cpu = atoi(optarg);
+            break;
+        case 'a':
+            max_backoff = atoi(optarg);
+            break;
+        case 'E':
+            tx_mode = atoi(optarg);
+            break;
+        case 'G':
+            high_rate = true;
+            break;
+        case 'I':
+            uring = true;
+            break;
         case 'i':
             init_spacing = atoi(optarg);
             break;
+        case 'C':
+            calib_file = optarg;
+            break;
         case 'c':
             init_pkt_size = atoi(optarg);
             break;
+        case 'k':
+            recal_interval = atoi(optarg);
+            break;
+        case 'L':
+            report_level = atoi(optarg);
+            break;
         case 'l':
             min_pkt_size = atoi(optarg);
             break;
         case 'm':
             n_streams = atoi(optarg);
             break;
+        case 'N':
+            nshards = atoi(optarg);
+            break;
+        case 'B':
+            busy_poll = atoi(optarg);
+            break;
         case 'n':
             stream_length = atoi(optarg);
             break;
@@ -114,12 +192,34 @@ int main(int argc, char **argv)
         case 's':
             inter_stream_spacing = atoi(optarg) * 1000; // input as millisec, internal as microsec
             break;
+        case 'T':
+            nlanes = atoi(optarg);
+            break;
         case 'u':
             sched_up = true;
             break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 'q':
+            pm_qos = true;
+            break;
         case 'v':
             verbose++;
             break;
+#if HAVE_PROBE_TAP
+        case 'K':
+            tap_dev = optarg;
+            break;
+        case 'D':
+            tap_drop = true;
+            break;
+#endif
+#if HAVE_AF_XDP
+        case 'X':
+            xdp_dev = optarg;
+            break;
+#endif
 #if HAVE_PCAP_H
         case 'x':
             pcap_dev = optarg;
@@ -148,6 +248,15 @@ int main(int argc, char **argv)
         ys->setResolution(resolution);
         ys->setInitialSpacing(init_spacing);
         ys->setInitialPktSize(init_pkt_size);
+        ys->setMaxBackoff(max_backoff);
+        ys->setRealtime(sched_up);
+        ys->setPacerCpu(pacer_cpu);
+        ys->setReportLevel(report_level);
+        ys->setHighRate(high_rate);
+        ys->setLanes(nlanes);
+        ys->setTxMode(tx_mode);
+        ys->setWarmup(warmup);
+        ys->setPmQos(pm_qos);
 
         yaz = ys;
     }
@@ -156,7 +265,19 @@ int main(int argc, char **argv)
         if (verbose)
             std::cout << "## starting yaz sender ##" << std::endl;
 
-        yaz = new YazReceiver();
+        YazReceiver *yr = new YazReceiver();
+
+        yr->setShards(nshards);
+        yr->setGro(high_rate);
+        yr->setBusyPoll(busy_poll);
+#if HAVE_AF_XDP
+        yr->setXdp(xdp_dev);
+#endif
+#if HAVE_PROBE_TAP
+        yr->setTap(tap_dev, tap_drop);
+#endif
+
+        yaz = yr;
     }
     else
     {
@@ -167,15 +288,19 @@ int main(int argc, char **argv)
     yaz->setCtrlDest(dest_control);
     yaz->setProbeDest(dest_port);
     yaz->setVerbosity(verbose);
+    yaz->setCalibFile(calib_file);
+    yaz->setRecalInterval(recal_interval);
+    yaz->setUring(uring);
 #if HAVE_PCAP_H
     yaz->setPcapDev(pcap_dev);
 #endif
 
 
 #if HAVE_SCHED_SETSCHEDULER
-    if (sched_up)
+    if (sched_up && receiver)
     {
-        // try to raise our scheduling priority.  
+        // try to raise our scheduling priority.  (the sender only
+        // raises its pacing thread - see YazSender::pacerLoop().)
         int maxprio = sched_get_priority_max(SCHED_RR);
         struct sched_param sp = { maxprio };
         if (sched_setscheduler(0, SCHED_RR, &sp) == 0)
@@ -40,6 +40,7 @@
 #endif
 
 #include <list>
+#include <algorithm>
 
 #if HAVE_PCAP_H
 static int offset = 0;
@@ -85,8 +86,11 @@ void pcap_callback(u_char *arg, const pcap_pkthdr *ph, const u_char *pkt)
     ProbeStamp ps;
     ps.m_ts = ph->ts;
     ps.m_ttl = iph->ip_ttl;
+    ps.m_session = ntohl(pp->m_session);
     ps.m_stream = ntohl(pp->m_stream);
     ps.m_sequence = ntohl(pp->m_sequence);
+    if (ps.m_sequence == YAZWARMUPSEQ)
+        return;
         
     pthread_mutex_lock(ppc->m_mutex);
     (ppc->m_tlist)->push_back(ps);
@@ -210,87 +214,190 @@ void YazEndPt::unprepPcap()
 #endif // HAVE_PCAP_H
 
 
-void YazEndPt::measureSyscallOverhead()
+double measure_syscall_overhead(int nsamples, int verbose)
 {
-    struct timeval tvli[YAZOSTIMINGSAMPLES];
-    for (int i = 0; i < YAZOSTIMINGSAMPLES; ++i)
-        gettimeofday(&tvli[i], 0);
+    assert (nsamples > 2 && nsamples <= YAZOSTIMINGSAMPLES);
+    long long tsli[YAZOSTIMINGSAMPLES];
+    for (int i = 0; i < nsamples; ++i)
+        tsli[i] = now_nsecs();
 
+    // on the stack: this is rerun between streams (recalibrate()).
     double diffsum = 0.0;
-    struct timeval diff = {0,0};
-    std::list<double> diffli;
+    double diffs[YAZOSTIMINGSAMPLES];
 
-    for (int i = 1; i < YAZOSTIMINGSAMPLES; ++i)
+    for (int i = 1; i < nsamples; ++i)
     {
-        timersub(&tvli[i], &tvli[i-1], &diff);
-        double d =  diff.tv_sec * 1000000.0 + double(diff.tv_usec);
+        double d = (tsli[i] - tsli[i-1]) / 1000.0;
         diffsum += d;
-        diffli.push_back(d);
+        diffs[i-1] = d;
     }
-    diffli.sort();
-
-    std::list<double>::iterator it = diffli.begin();
-    for (int i = 0; i < YAZOSTIMINGSAMPLES/2; ++i, ++it) ;
-    double median = *it;
+    std::nth_element(diffs, diffs + nsamples/2, diffs + nsamples - 1);
+    double median = diffs[nsamples/2];
     
-    double sco = diffsum / (YAZOSTIMINGSAMPLES - 1);
-    if (m_verbose)
+    double sco = diffsum / (nsamples - 1);
+    if (verbose)
     {
         std::cout << "##syscall overhead mean: " << sco << " microseconds" << std::endl;
         std::cout << "##syscall overhead median: " << median << " microseconds" << std::endl;
     }
-    m_syscall_overhead = int(sco);
+    return sco;
 }
 
 
-void YazEndPt::measureMinSleep()
+double measure_min_sleep(int nsamples, int verbose)
 {
-    struct timeval ts[YAZOSTIMINGSAMPLES];
-    gettimeofday(&ts[0], 0);
-    for (int i = 1; i < YAZOSTIMINGSAMPLES; ++i)
+    // time taken by the shortest possible sleep, the same way the
+    // pacing loop sleeps (see sleep_until_nsecs()).
+    assert (nsamples > 2 && nsamples <= YAZOSTIMINGSAMPLES);
+    long long ts[YAZOSTIMINGSAMPLES];
+    ts[0] = now_nsecs();
+    for (int i = 1; i < nsamples; ++i)
     {
-        usleep(1);
-        gettimeofday(&ts[i], 0);
+        sleep_until_nsecs(ts[i-1] + 1000);
+        ts[i] = now_nsecs();
     }
 
     double usecsum = 0.0;
     double usecsumsq = 0.0;
-    int imax = 0;
-    struct timeval diff = {0,0};
-    std::list<double> diffli;
-    for (int i = 1; i < YAZOSTIMINGSAMPLES; ++i)
+    double imax = 0;
+    double diffs[YAZOSTIMINGSAMPLES];
+    for (int i = 1; i < nsamples; ++i)
     {
-        timersub(&ts[i], &ts[i-1], &diff);
-        double usecs = diff.tv_sec * 1000000.0 + double(diff.tv_usec);
+        double usecs = (ts[i] - ts[i-1]) / 1000.0;
         usecsum += usecs;
         usecsumsq += pow(usecs, 2.0);
-        imax = std::max(imax, int(diff.tv_sec * 1000000 + diff.tv_usec)); 
-        diffli.push_back(diff.tv_sec * 1000000.0 + double(diff.tv_usec));
-    }
-    diffli.sort();
-    std::list<double>::iterator it = diffli.begin();
-    for (int i = 0; i < YAZOSTIMINGSAMPLES/2; ++i, ++it) ;
-    double median = *it;
-    double mean = usecsum / double(YAZOSTIMINGSAMPLES - 1); 
-    double stdev = sqrt((usecsumsq * (YAZOSTIMINGSAMPLES - 1) - pow(usecsum,2.0)) / (double(YAZOSTIMINGSAMPLES - 2) * double(YAZOSTIMINGSAMPLES - 1)));
+        imax = std::max(imax, usecs); 
+        diffs[i-1] = usecs;
+    }
+    std::nth_element(diffs, diffs + nsamples/2, diffs + nsamples - 1);
+    double median = diffs[nsamples/2];
+    double mean = usecsum / double(nsamples - 1); 
+    double stdev = sqrt((usecsumsq * (nsamples - 1) - pow(usecsum,2.0)) / (double(nsamples - 2) * double(nsamples - 1)));
      
-
-    // m_min_sleep is the minimun amount of time (usecs) that we'll attempt
-    // to sleep.  otherwise, we spin-wait.
-    m_min_sleep = std::max(0, int(mean + (3 * stdev)));
-
-    if (m_verbose)
+    if (verbose)
     {
         std::cout << "##mean sleep: " << mean << " microseconds" << std::endl;
         std::cout << "##stdev sleep: " << stdev << " microseconds" << std::endl;
         std::cout << "##median sleep: " << median << " microseconds" << std::endl;
         std::cout << "##max sleep: " << imax << " microseconds" << std::endl;
     }
+
+    // the minimun amount of time (usecs) that we'll attempt
+    // to sleep.  otherwise, we spin-wait.
+    return std::max(0.0, mean + (3 * stdev));
+}
+
+
+void set_timer_slack(int verbose)
+{
+    // the default 50us timer slack lets the kernel defer our wakeups
+    // to batch them with others; the pacing thread wants them exact.
+#if HAVE_SYS_PRCTL_H && defined(PR_SET_TIMERSLACK)
+    if (prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0) < 0)
+        std::cerr << "!! (non-fatal) couldn't set timer slack: " << errno << '/' << strerror(errno) << std::endl;
+    else if (verbose > 1)
+        std::cout << "##timer slack: " << prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0) << " nanoseconds" << std::endl;
+#endif
+}
+
+
+// write out a whole iovec, however the stream socket splits it.  the
+// caller's iovec is used up in the process.
+bool send_iov(int sd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    while (msg.msg_iovlen > 0)
+    {
+        ssize_t n = sendmsg(sd, &msg, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            // a non-blocking socket: give a slow peer a little while,
+            // but not for ever.
+            struct pollfd pfd;
+            pfd.fd = sd;
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, YAZCTRLSENDWAIT) > 0)
+                continue;
+            return false;
+        }
+        if (n <= 0)
+            return false;
+
+        while (msg.msg_iovlen > 0 && size_t(n) >= msg.msg_iov->iov_len)
+        {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+
+// control messages are small and each waits on the last; don't let
+// Nagle hold one back waiting for an ack.
+void set_nodelay(int sd)
+{
+    int on = 1;
+    if (setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+        std::cerr << "!! (non-fatal) couldn't set TCP_NODELAY on control socket: " << errno << '/' << strerror(errno) << std::endl;
+}
+
+void YazEndPt::measureSyscallOverhead()
+{
+    m_smooth_overhead = measure_syscall_overhead(YAZOSTIMINGSAMPLES, m_verbose);
+    m_syscall_overhead = int(m_smooth_overhead);
+}
+
+
+void YazEndPt::measureMinSleep()
+{
+    m_smooth_min_sleep = measure_min_sleep(YAZOSTIMINGSAMPLES, m_verbose);
+    m_min_sleep = int(m_smooth_min_sleep);
+}
+
+
+void YazEndPt::recalibrate(bool with_sleep)
+{
+    // cheap, low duty-cycle re-measurement of the timing overheads,
+    // called between streams.  a handful of samples is folded into
+    // an ewma of each value, and the integer values used by the
+    // timed loops are then replaced together so that a stream never
+    // runs with a mix of old and new calibration.
+    double sco = measure_syscall_overhead(YAZRECALSAMPLES, 0);
+    m_smooth_overhead += YAZRECALALPHA * (sco - m_smooth_overhead);
+
+    if (with_sleep)
+    {
+        double msl = measure_min_sleep(YAZRECALSAMPLES, 0);
+        m_smooth_min_sleep += YAZRECALALPHA * (msl - m_smooth_min_sleep);
+    }
+
+    int overhead = int(m_smooth_overhead);
+    int min_sleep = int(m_smooth_min_sleep);
+
+    if (m_verbose > 2 && (overhead != m_syscall_overhead || min_sleep != m_min_sleep))
+        std::cout << "##recalibrated syscall overhead/min sleep: " << overhead << '/' << min_sleep << " microseconds" << std::endl;
+
+    m_syscall_overhead = overhead;
+    m_min_sleep = min_sleep;
 }
 
 
 #if 0
-bool YazEndPt::isValidStream(std::vector<ProbeStamp> *vps, int min_hint)
+bool YazEndPt::isValidStream(YazStampVec *vps, int min_hint)
 {
     bool rv = true;
     float microthresh = 1000000.0 / m_clock_tick / 2.0;
@@ -310,7 +417,7 @@ bool YazEndPt::isValidStream(std::vector<ProbeStamp> *vps, int min_hint)
 #endif
 
 
-bool YazEndPt::getSpacing(std::vector<ProbeStamp> *vps,
+bool YazEndPt::getSpacing(YazStampVec *vps,
                           float &mean, int &nused, int &nlost, int min_hint)
 {
     bool rv = true;
@@ -321,10 +428,15 @@ bool YazEndPt::getSpacing(std::vector<ProbeStamp> *vps,
     nused = 0;
     nlost = 0;
 
+    // probes from several sending lanes, or a path that reorders, can
+    // arrive out of sequence; spacings are taken in sequence order.
+    if (!std::is_sorted(vps->begin(), vps->end(), by_sequence))
+        std::sort(vps->begin(), vps->end(), by_sequence);
+
     if (m_verbose > 1)
         std::cout << "##spc";
 
-    std::list<float> spacings;
+    float sum = 0, n = 0;
     for (size_t i = 1; i < vps->size() && rv; ++i)
     {
         bool lost = false;
@@ -351,18 +463,12 @@ bool YazEndPt::getSpacing(std::vector<ProbeStamp> *vps,
         // definitely include lost
         // if (lost || (m > MIN_SPACE && m < microthresh)) // FIXME min spa???
         if (lost || m < microthresh) // FIXME min spa???
-            spacings.push_back(m);
+        {
+            sum += m;
+            n += 1;
+        }
     }
 
-
-    float sum = 0, n = 0;
-    for (std::list<float>::const_iterator iter = spacings.begin();
-         iter != spacings.end(); ++iter)
-    {
-        sum += *iter;
-        n += 1;
-    }
-     
     nused = int(n);
 
     if (rv && n > 1)
@@ -381,7 +487,76 @@ bool YazEndPt::getSpacing(std::vector<ProbeStamp> *vps,
 }
 
 
-bool YazEndPt::checkTTL(std::vector<ProbeStamp> *vps, unsigned int &ttl)
+void YazSpacingStats::add(const ProbeStamp &ps, long long sent, float microthresh, int spacing)
+{
+    if (sent)
+    {
+        long long owd = ps.m_ts.tv_sec * 1000000000LL + ps.m_ts.tv_usec * 1000LL - sent;
+        if (m_owd_count == 0 || owd < m_owd_min)
+            m_owd_min = owd;
+        if (m_owd_count == 0 || owd > m_owd_max)
+            m_owd_max = owd;
+        m_owd_sum += owd;
+        m_owd_count++;
+    }
+
+    if (m_stamps++ == 0)
+    {
+        m_last_seq = ps.m_sequence;
+        m_last_ts = ps.m_ts;
+        return;
+    }
+
+    bool lost = false;
+    if (ps.m_sequence != m_last_seq + 1)
+    {
+        // losses count but reordering spoils the stream, until
+        // drainStream() sorts it and adds it up again.
+        lost = true;
+        if (ps.m_sequence > m_last_seq)
+            m_lost += ps.m_sequence - m_last_seq;
+        else
+            m_reorder++;
+    }
+
+    struct timeval diff;
+    timersub(&ps.m_ts, &m_last_ts, &diff);
+    float m = diff.tv_sec * 1000000.0 + float(diff.tv_usec);
+
+    if (!lost && spacing > 0)
+    {
+        double err = (diff.tv_sec * 1000000.0 + diff.tv_usec) * 1000.0 - spacing;
+        m_err_sum += err;
+        m_err_sumsq += err * err;
+        m_err_count++;
+    }
+
+    if (lost || m < microthresh)
+    {
+        if (m_count == 0 || m < m_min)
+            m_min = m;
+        if (m_count == 0 || m > m_max)
+            m_max = m;
+        m_sum += m;
+        m_sumsq += double(m) * m;
+        m_count++;
+    }
+
+    m_last_seq = ps.m_sequence;
+    m_last_ts = ps.m_ts;
+}
+
+
+float YazSpacingStats::stddev() const
+{
+    if (m_count < 2)
+        return 0.0;
+    double var = (m_sumsq - m_sum * m_sum / m_count) / (m_count - 1);
+    return var > 0.0 ? float(sqrt(var)) : 0.0;
+}
+
+
+bool YazEndPt::checkTTL(YazStampVec *vps, unsigned int &ttl)
 {
     if (vps->size() == 0)
         return true;
@@ -441,43 +616,348 @@ void YazEndPt::getClockTick()
 }
 
 
-// ProbeStamp to SendProbeStamp
-void ps_to_sps(const ProbeStamp& ps, PsVec::SendProbeStamp& sps){
-    sps.set_m_sequence(ps.m_sequence);
-    sps.set_m_stream(ps.m_stream);
-    sps.set_m_ttl(ps.m_ttl);
+YazPoller::YazPoller()
+#if HAVE_SYS_EPOLL_H
+    : m_epfd(-1)
+#endif
+{
+#if HAVE_IO_URING
+    m_ring = 0;
+    m_recv_fd = -1;
+    m_recv_armed = false;
+#endif
+}
+
 
-    google::protobuf::Timestamp* stv = new google::protobuf::Timestamp;
-    stv->set_seconds(ps.m_ts.tv_sec);
-    stv->set_nanos(ps.m_ts.tv_usec);
-    sps.set_allocated_m_tv(stv);
+YazPoller::~YazPoller()
+{
+#if HAVE_SYS_EPOLL_H
+    if (m_epfd >= 0)
+        close(m_epfd);
+#endif
+#if HAVE_IO_URING
+    delete m_ring;
+#endif
 }
 
-// SendProbeStamp to ProbeStamp
-void sps_to_ps(const PsVec::SendProbeStamp& sps, ProbeStamp& ps){
+
+void YazPoller::init(bool uring, int verbose)
+{
+#if HAVE_IO_URING
+    delete m_ring;
+    m_ring = 0;
+    m_rearm.clear();
+    m_recvd.clear();
+    m_recv_fd = -1;
+    m_recv_armed = false;
+    if (uring)
+    {
+        m_ring = new YazUring();
+        if (m_ring->open(YAZURINGENTRIES, verbose))
+            return;
+        std::cerr << "!! (non-fatal) io_uring unavailable - using the default I/O engine" << std::endl;
+        delete m_ring;
+        m_ring = 0;
+    }
+#endif
+
+#if HAVE_SYS_EPOLL_H
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epfd < 0)
+    {
+        std::cerr << "!!epoll_create(): " << errno << '/' << strerror(errno) << std::endl;
+        throw -1;
+    }
+    m_events.resize(YAZMAXEVENTS);
+#else
+    m_pfds.clear();
+#endif
+}
+
+
+void YazPoller::add(int fd)
+{
+#if HAVE_IO_URING
+    if (m_ring)
+    {
+        armPoll(fd);
+        return;
+    }
+#endif
+#if HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        std::cerr << "!!epoll_ctl(): " << errno << '/' << strerror(errno) << std::endl;
+        throw -1;
+    }
+#else
+    pollfd pfd = {fd, POLLIN, 0};
+    m_pfds.push_back(pfd);
+#endif
+}
+
+
+void YazPoller::remove(int fd)
+{
+#if HAVE_IO_URING
+    if (m_ring)
+    {
+        disarm(fd);
+        return;
+    }
+#endif
+#if HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, &ev);
+#else
+    for (std::vector<pollfd>::iterator it = m_pfds.begin(); it != m_pfds.end(); ++it)
+    {
+        if (it->fd == fd)
+        {
+            m_pfds.erase(it);
+            break;
+        }
+    }
+#endif
+}
+
+
+int YazPoller::wait(std::vector<int> &ready, int timeout)
+{
+    ready.clear();
+
+#if HAVE_IO_URING
+    if (m_ring)
+        return (waitRing(ready, timeout));
+#endif
+
+#if HAVE_SYS_EPOLL_H
+    int n = epoll_wait(m_epfd, &m_events[0], m_events.size(), timeout);
+    for (int i = 0; i < n; ++i)
+        ready.push_back(m_events[i].data.fd);
+#else
+    int n = poll(&m_pfds[0], m_pfds.size(), timeout);
+    for (size_t i = 0; n > 0 && i < m_pfds.size(); ++i)
+    {
+        if (m_pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            ready.push_back(m_pfds[i].fd);
+        m_pfds[i].revents = 0;
+    }
+#endif
+
+    if (n < 0 && errno == EINTR)
+        return 0;
+    return n;
+}
+
+
+bool YazChangeDetector::update(float x, float floor)
+{
+    // page-hinkley: accumulate deviations from the running mean (less
+    // a tolerance of m_delta) in each direction, and signal a change
+    // when either cumulative sum drifts more than m_lambda away from
+    // its extreme.  deviations are scaled by the mean (but by no less
+    // than floor) so a shift is judged relative to the path rate.
+    m_n++;
+    m_mean += (x - m_mean) / m_n;
+    if (m_n == 1)
+        return false;
+
+    double dev = (x - m_mean) / std::max(double(floor), fabs(m_mean));
+
+    m_cum_up += dev - m_delta;
+    m_min_up = std::min(m_min_up, m_cum_up);
+
+    m_cum_down += dev + m_delta;
+    m_max_down = std::max(m_max_down, m_cum_down);
+
+    return ((m_cum_up - m_min_up) > m_lambda ||
+            (m_max_down - m_cum_down) > m_lambda);
+}
+
+
+// stamp i of a column set to SendProbeStamp.  the nanos field has
+// always carried usecs on the wire, so it still does.
+static void ps_to_sps(const YazStamps& st, int i, PsVec::SendProbeStamp& sps){
+    sps.set_m_sequence(st.m_seq[i]);
+    sps.set_m_stream(st.m_stream);
+    sps.set_m_ttl(st.m_ttl[i]);
+
+    google::protobuf::Timestamp* stv = sps.mutable_m_tv();
+    stv->set_seconds(st.m_ns[i] / 1000000000ULL);
+    stv->set_nanos((st.m_ns[i] % 1000000000ULL) / 1000);
+}
+
+// SendProbeStamp appended to a column set
+static bool sps_to_ps(const PsVec::SendProbeStamp& sps, YazStamps& st){
+    ProbeStamp ps;
     ps.m_sequence = sps.m_sequence();
-    ps.m_stream = sps.m_stream();
     ps.m_ttl = sps.m_ttl();
     ps.m_ts.tv_sec = sps.m_tv().seconds();
     ps.m_ts.tv_usec = sps.m_tv().nanos();
+    return st.add(ps);
 }
 
 
-PsVec::SendProbeStampVec serialize_psvec(const std::vector<ProbeStamp>& ps_vec){
-    PsVec::SendProbeStampVec res;
-    for (const auto& ps : ps_vec){
-        auto sps = res.add_m_app_probes_ptr();
-        ps_to_sps(ps, *sps);
-    }
-    return res;
+static google::protobuf::ArenaOptions psvec_arena_options(std::vector<char> &block)
+{
+    google::protobuf::ArenaOptions opts;
+    opts.initial_block = &block[0];
+    opts.initial_block_size = block.size();
+    return opts;
+}
+
+
+YazPsVecCodec::YazPsVecCodec() :
+    m_block(YAZPSVECARENA), m_arena(psvec_arena_options(m_block))
+{
+}
+
+
+YazPsVecCodec::YazPsVecCodec(const YazPsVecCodec &) :
+    m_block(YAZPSVECARENA), m_arena(psvec_arena_options(m_block))
+{
+}
+
+
+PsVec::SendProbeStampVec *YazPsVecCodec::fresh()
+{
+    m_arena.Reset();
+    return google::protobuf::Arena::CreateMessage<PsVec::SendProbeStampVec>(&m_arena);
+}
+
+
+void YazPsVecCodec::encode(const YazStamps &stamps, std::string &out)
+{
+    PsVec::SendProbeStampVec *msg = fresh();
+    msg->mutable_m_app_probes_ptr()->Reserve(stamps.size());
+    for (int i = 0; i < stamps.size(); ++i)
+        ps_to_sps(stamps, i, *msg->add_m_app_probes_ptr());
+    msg->SerializeToString(&out);
+}
+
+
+// decode into out; a report longer than a stream can be is refused.
+bool YazPsVecCodec::decode(const char *buf, int len, YazStamps &out)
+{
+    out.clear();
+    PsVec::SendProbeStampVec *msg = fresh();
+    if (!msg->ParseFromArray(buf, len))
+        return false;
+
+    if (msg->m_app_probes_ptr_size() > 0)
+        out.m_stream = msg->m_app_probes_ptr(0).m_stream();
+    for (int i = 0; i < msg->m_app_probes_ptr_size(); i++)
+        if (!sps_to_ps(msg->m_app_probes_ptr(i), out))
+            return false;
+    return true;
+}
+
+
+static size_t page_size()
+{
+#if HAVE_SYSCONF
+    long ps = sysconf(_SC_PAGESIZE);
+    if (ps > 0)
+        return ps;
+#endif
+    return 4096;
+}
+
+
+// fault in every page of a live object without changing it.
+void YazArena::prefault(void *p, size_t len)
+{
+    size_t ps = page_size();
+    volatile char *c = (volatile char *)p;
+    for (size_t off = 0; off < len; off += ps)
+        c[off] = c[off];
+    if (len)
+        c[len - 1] = c[len - 1];
 }
 
-std::vector<ProbeStamp> deserialize_psvec(const PsVec::SendProbeStampVec& sps_vec){
-    std::vector<ProbeStamp> res;
-    for(int i=0; i < sps_vec.m_app_probes_ptr_size(); i++){
-        ProbeStamp ps;
-        sps_to_ps(sps_vec.m_app_probes_ptr(i), ps);
-        res.emplace_back(ps);
+
+bool YazArena::open(size_t len, int verbose)
+{
+    close();
+    if (!len)
+        return true;
+
+    void *base = MAP_FAILED;
+#if HAVE_MAP_HUGETLB
+    // huge pages only come from the reserved pool; without one this
+    // fails at once and we use ordinary pages instead.
+    const size_t huge = 2 * 1024 * 1024;
+    size_t hlen = (len + huge - 1) / huge * huge;
+    base = mmap(0, hlen, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (base != MAP_FAILED)
+    {
+        m_len = hlen;
+        m_huge = true;
+    }
+#endif
+    if (base == MAP_FAILED)
+    {
+        size_t ps = page_size();
+        m_len = (len + ps - 1) / ps * ps;
+        base = mmap(0, m_len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (base == MAP_FAILED)
+        {
+            std::cerr << "!!couldn't map " << m_len << " bytes of buffers: " << errno << '/' << strerror(errno) << std::endl;
+            m_len = 0;
+            return false;
+        }
+#if HAVE_MAP_HUGETLB
+        madvise(base, m_len, MADV_HUGEPAGE);
+#endif
     }
-    return res;
+    m_base = (char *)base;
+    m_used = 0;
+
+    // MAP_POPULATE is only a hint; writing makes sure every page is
+    // backed, and writable, before anything is timed.
+    memset(m_base, 0, m_len);
+#if HAVE_MLOCK
+    if (mlock(m_base, m_len) == 0)
+        m_locked = true;
+    else
+        std::cerr << "!! (non-fatal) couldn't lock " << m_len << " bytes of buffers: " << errno << '/' << strerror(errno) << std::endl;
+#endif
+
+    if (verbose)
+        std::cout << "## buffer arena: " << m_len << " bytes on " << (m_huge ? "huge" : "ordinary") << " pages" << (m_locked ? ", locked" : "") << std::endl;
+    return true;
+}
+
+
+void YazArena::close()
+{
+    if (!m_base)
+        return;
+#if HAVE_MLOCK
+    if (m_locked)
+        munlock(m_base, m_len);
+#endif
+    munmap(m_base, m_len);
+    m_base = 0;
+    m_len = m_used = 0;
+    m_huge = m_locked = false;
+}
+
+
+// the next len bytes, cache line aligned, or 0 once the arena is full.
+void *YazArena::take(size_t len)
+{
+    size_t off = (m_used + 63) & ~size_t(63);
+    if (!m_base || off + len > m_len)
+        return 0;
+    m_used = off + len;
+    return m_base + off;
 }
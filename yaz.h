@@ -38,14 +38,20 @@
 #include <netinet/in_systm.h>
 #include <netinet/ip.h>
 #include <netinet/udp.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <poll.h>
+#include <sys/mman.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
 #include <vector>
+#include <algorithm>
 #include <list>
+#include <map>
+#include <bitset>
 #include <string>
 #include <assert.h>
 #include <limits.h>
@@ -60,6 +66,41 @@
 #if HAVE_STRING_H
 #include <string.h>
 #endif
+#if HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
+#if HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#if HAVE_REUSEPORT_CBPF
+#include <linux/filter.h>
+#endif
+#if HAVE_PACKET_TX_RING
+#include <linux/if_packet.h>
+#endif
+#if HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+#if HAVE_SIOCOUTQ
+#include <linux/sockios.h>
+#endif
+#if HAVE_TX_TIMESTAMPING
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#endif
+#if HAVE_AF_XDP
+#include <linux/if_xdp.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#endif
+
+// backends that build their own probe frames
+#define HAVE_FRAME_TX (HAVE_PACKET_TX_RING || HAVE_AF_XDP)
+#define HAVE_PROBE_TAP (HAVE_AF_XDP && HAVE_BPF_RINGBUF)
+#if HAVE_FRAME_TX
+#include <net/ethernet.h>
+#include <net/if.h>
+#endif
 
 #include "../abet.h"
 //#include "tmp_abet.h"
@@ -67,14 +108,59 @@
 
 static const int YAZBUFLEN = 4096;
 static const int YAZTINYBUF = 32;
-static const int YAZPCAPSNAPLEN = 64;
+static const int YAZPCAPSNAPLEN = 96;    // link + ip + udp + YazPkt
 static const int YAZOSTIMINGSAMPLES = 100;
+static const int YAZLISTENBACKLOG = 64;
+static const int YAZMAXEVENTS = 64;
+static const int YAZMAXSHARDS = 64;
+static const int YAZSHARDDRAIN = 10;    // msecs to wait for a shard's queue
+static const int YAZCTRLSENDWAIT = 1000; // msecs a control reply may wait on a full socket
+static const int YAZSLABCAP = 250;      // longest stream, in probes
+static const int YAZSLABS = 4;          // streams buffered per session
+static const int YAZSLABAGE = 5000;     // msecs before an idle stream is dropped
+static const int YAZPSVECARENA = 65536; // arena bytes for a stamp report of YAZSLABCAP probes
+static const int YAZREPORTBUFLEN = 16384; // bytes for the largest report of YAZSLABCAP probes
+static const int YAZGSOSEGS = 64;       // most segments in one UDP_SEGMENT send
+static const int YAZGSOMAX = 65000;     // most payload bytes in one UDP_SEGMENT send
+static const int YAZGROBUFLEN = 65536;  // receive buffer big enough for a GRO batch
+static const int YAZTXRINGWAIT = 100;   // msecs to wait for the ring to drain
+static const int YAZXSKRING = 1024;     // entries in each AF_XDP ring
+static const int YAZXSKFRAMESIZE = 2048;
+static const int YAZTAPRING = 1 << 20;  // bytes in the probe tap ring buffer
+static const int YAZURINGENTRIES = 256; // io_uring submission queue entries
+static const int YAZURINGBUFS = 256;    // provided probe receive buffers
+static const int YAZURINGBUFLEN = 2048; // bytes per buffer (without GRO)
+static const int YAZURINGLEAD = 200;    // usecs from queueing a stream to its first probe
+static const int YAZBUSYGRACE = 100;    // msecs past a stream's expected end to keep busy-polling
+static const int YAZBUSYBUDGET = 64;    // packets per busy-poll pass
+static const unsigned int YAZWARMUPSEQ = 0xffffffff;    // sequence number of an untimed warmup probe
+static const int YAZMAXWARMUP = 16;     // most warmup probes before a stream
+static const int YAZWARMUPLEAD = 50;    // usecs from the last warmup probe to the stream
+static const char * const YAZPMQOSDEV = "/dev/cpu_dma_latency";
+static const int YAZLOCALRESENDS = 2;   // resends of a stream that left badly spaced
+static const float YAZLOCALSLACK = 0.1; // departure spacing error allowed, as a fraction of the target
+static const int YAZLOCALBUNCH = 10;    // percent of gaps under half the target that make a stream bunched
+static const int YAZOUTQPROBES = 2;     // probes left queued at the end of a stream that make a backlog
+static const int YAZTXSTAMPWAIT = 2;    // msecs to wait for a stream's last transmit timestamps
+static const char * const YAZCALIBFILE = ".yaz_calib";
+static const int YAZRECALSAMPLES = 10;
+static const double YAZRECALALPHA = 0.125;
+static const int YAZRECALINTERVAL = 10;
 
 static const int MIN_SPACE = 20;
 static const int MAX_SPACE = 1000;
+static const int MIN_SPACE_GSO = 0;     // back-to-back trains in high-rate mode
 
 static const int RETRY_LIMIT = 5;
 
+static const int PACER_WATCHDOG = 1000;    // milliseconds over expected stream time
+static const int PACER_STACK_PREFAULT = 65536;
+static const int PACER_LANE_LEAD = 1000;    // microseconds from request to first probe, multi-lane
+static const int PACER_MAX_LANES = 16;
+
+static const int MAX_BACKOFF = 64;
+static const int MAX_SLEEP_MEANS = 10;  // cap on a backed-off exponential sleep, in means
+
 static const unsigned short DEST_CTRL_PORT = 13979;
 static const unsigned short DEST_PORT   = 13989;
 
@@ -85,6 +171,25 @@ static const unsigned short DEST_PORT   = 13989;
 #define PCTRL_RST_ACK       0x0000BEEF
 #define PCTRL_RST_NACK      0x0BADBEEF
 
+// sent just before a stream, with the stream's expected duration
+// (usecs) in m_reason.  it gets no reply; a receiver that predates it
+// answers PCTRL_INVALID, and the sender stops sending it.
+#define PCTRL_STREAM        0x0000F00D
+
+// what a RST-ACK carries besides the spacing summary.  the extra part
+// (loss bitmap, serialized stamps, or bitmap and one-way delays)
+// follows the YazRstResponse and its length is given in m_ps_vec_len.
+#define PREPORT_SUMMARY     0x00000000
+#define PREPORT_LOSSMAP     0x00000001
+#define PREPORT_STAMPS      0x00000002
+#define PREPORT_DELAYS      0x00000003
+
+// how the sender puts probes on the wire
+#define PTX_SOCKET          0
+#define PTX_RING            1       // prebuilt frames in a PACKET_TX_RING
+#define PTX_RING_BYPASS     2       // same, skipping the qdisc
+#define PTX_XDP             3       // prebuilt frames in an AF_XDP umem
+
 // control message timeout
 const int ctrl_msg_timeout = 10000;    // milliseconds (long!)
 #if HAVE_PCAP_H
@@ -121,15 +226,68 @@ const int pcap_wait_timeout = 5000;    // milliseconds (long!)
         } while (0)
 #endif
 
+//
+// pacing clock.  deadlines are kept in nanoseconds on the monotonic
+// clock where it is available, and waited for with an absolute sleep
+// so that time spent computing the sleep doesn't add to it.
+//
+static inline long long now_nsecs()
+{
+#if HAVE_CLOCK_NANOSLEEP
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000000LL + ts.tv_nsec);
+#else
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return (tv.tv_sec * 1000000000LL + tv.tv_usec * 1000LL);
+#endif
+}
+
+static inline void sleep_until_nsecs(long long deadline)
+{
+#if HAVE_CLOCK_NANOSLEEP
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000LL;
+    ts.tv_nsec = deadline % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR)
+        ;
+#else
+    long long remain = deadline - now_nsecs();
+    if (remain > 0)
+        usleep(remain / 1000);
+#endif
+}
+
+// offset that takes a now_nsecs() reading to wall-clock time
+static inline long long wallclock_offset()
+{
+    struct timeval tv;
+    long long before = now_nsecs();
+    gettimeofday(&tv, 0);
+    long long after = now_nsecs();
+    return (tv.tv_sec * 1000000000LL + tv.tv_usec * 1000LL) - (before + after) / 2;
+}
+
+static inline void nsecs_to_timeval(long long ns, struct timeval &tv)
+{
+    tv.tv_sec = ns / 1000000000LL;
+    tv.tv_usec = (ns % 1000000000LL) / 1000;
+}
+
+
 struct YazCtrlMsg
 {
-    YazCtrlMsg(): m_code(PCTRL_INVALID), m_seq(0), m_len(0), m_reason(0), m_ps_vec_len(0) {}
+    YazCtrlMsg(): m_code(PCTRL_INVALID), m_seq(0), m_len(0), m_reason(0), m_ps_vec_len(0), m_session(0), m_stream(0), m_report(PREPORT_SUMMARY) {}
 
     int m_code;
     int m_seq;
     int m_len;
     int m_reason;
     int m_ps_vec_len;
+    int m_session;
+    int m_stream;           // stream a RST asks about
+    int m_report;           // PREPORT_* level a RST asks for
 };
 
 
@@ -147,25 +305,442 @@ struct YazRstResponse
 
 struct ProbeStamp
 {
-    ProbeStamp(): m_stream(0), m_sequence(0), m_ttl(0)
+    ProbeStamp(): m_session(0), m_stream(0), m_sequence(0), m_ttl(0)
         {
             m_ts.tv_sec = 0;
             m_ts.tv_usec = 0;
         }
 
+    unsigned int m_session;     // takes what was padding before m_ts
     unsigned int m_stream;
     unsigned int m_sequence;
     unsigned int m_ttl;
     struct timeval m_ts;
 };
 
+inline bool by_sequence(const ProbeStamp &a, const ProbeStamp &b)
+{
+    return (a.m_sequence < b.m_sequence);
+}
+
+
+// memory for the buffers a stream touches, set up before the first
+// stream: one mapping, on huge pages where the system has them (else
+// on ordinary pages, with a transparent huge page hint), written
+// through once and locked so that neither the timed send loop nor
+// the probe receive path takes a page fault.  buffers are carved off
+// in order and all go back together on close().  a copy starts out
+// without any.
+class YazArena
+{
+public:
+    YazArena() : m_base(0), m_len(0), m_used(0), m_huge(false), m_locked(false) {}
+    YazArena(const YazArena &) : m_base(0), m_len(0), m_used(0), m_huge(false), m_locked(false) {}
+    YazArena &operator=(const YazArena &) { return *this; }
+    ~YazArena() { close(); }
+
+    bool open(size_t, int verbose);
+    void close();
+    void *take(size_t);
+    bool owns(const void *p) const
+        { return m_base && (const char *)p >= m_base && (const char *)p < m_base + m_len; }
+
+    static void prefault(void *, size_t);
+
+private:
+    char *m_base;
+    size_t m_len;
+    size_t m_used;
+    bool m_huge;
+    bool m_locked;
+};
+
+
+// an allocator that draws from a YazArena while there is room and
+// from the heap otherwise, or always from the heap without an arena.
+// arena memory is only returned when the arena closes, so a container
+// using it should be reserved up front and not grown.
+template <class T>
+struct YazArenaAlloc
+{
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    YazArenaAlloc() : m_arena(0) {}
+    explicit YazArenaAlloc(YazArena *a) : m_arena(a) {}
+    template <class U> YazArenaAlloc(const YazArenaAlloc<U> &o) : m_arena(o.m_arena) {}
+
+    T *allocate(size_t n)
+        {
+            void *p = m_arena ? m_arena->take(n * sizeof(T)) : 0;
+            if (!p)
+                p = ::operator new(n * sizeof(T));
+            return static_cast<T*>(p);
+        }
+
+    void deallocate(T *p, size_t)
+        {
+            if (!m_arena || !m_arena->owns(p))
+                ::operator delete(p);
+        }
+
+    YazArena *m_arena;
+};
+
+template <class T, class U>
+bool operator==(const YazArenaAlloc<T> &a, const YazArenaAlloc<U> &b) { return a.m_arena == b.m_arena; }
+template <class T, class U>
+bool operator!=(const YazArenaAlloc<T> &a, const YazArenaAlloc<U> &b) { return a.m_arena != b.m_arena; }
+
+typedef std::vector<ProbeStamp, YazArenaAlloc<ProbeStamp> > YazStampVec;
 
+
+// probe header.  the sender's departure time and intended spacing let
+// the receiver work out one-way delays and spacing errors by itself.
+// m_session must stay the third word: the receiver's reuseport filter
+// loads it from there.
 struct YazPkt
 {
-    YazPkt() : m_stream(0), m_sequence(0) {}
+    YazPkt() : m_stream(0), m_sequence(0), m_session(0), m_spacing(0),
+               m_sent_hi(0), m_sent_lo(0) {}
     
     int m_stream;
     int m_sequence;
+    int m_session;
+    int m_spacing;              // intended spacing, nsecs
+    unsigned int m_sent_hi;     // departure time, nsecs since the epoch
+    unsigned int m_sent_lo;
+};
+
+
+// running spacing statistics of one stream.  the rules are those of
+// YazEndPt::getSpacing(), applied to each probe as it arrives so that
+// a summary is ready as soon as the stream ends.
+struct YazSpacingStats
+{
+    YazSpacingStats() { reset(); }
+
+    void reset()
+        {
+            m_count = 0;
+            m_sum = m_sumsq = 0.0;
+            m_min = m_max = 0.0;
+            m_lost = 0;
+            m_reorder = 0;
+            m_stamps = 0;
+            m_owd_count = 0;
+            m_owd_sum = 0.0;
+            m_owd_min = m_owd_max = 0;
+            m_err_count = 0;
+            m_err_sum = m_err_sumsq = 0.0;
+            m_last_seq = 0;
+            timerclear(&m_last_ts);
+        }
+
+    void add(const ProbeStamp &, long long, float, int);
+    bool valid() const { return m_reorder == 0; }
+    float mean() const { return m_count > 1 ? float(m_sum / m_count) : 0.0; }
+    float stddev() const;
+    double owdMean() const { return m_owd_count ? m_owd_sum / m_owd_count : 0.0; }
+    double errMean() const { return m_err_count ? m_err_sum / m_err_count : 0.0; }
+
+    int m_count;                // spacings used
+    double m_sum;
+    double m_sumsq;
+    float m_min;
+    float m_max;
+    int m_lost;
+    int m_reorder;              // sequence numbers that went backwards
+    int m_stamps;
+    unsigned int m_last_seq;
+    struct timeval m_last_ts;
+
+    // from the probe headers, in nsecs: one-way delay (meaningful only
+    // with synchronized clocks) and arrival spacing less intended
+    // spacing, between consecutive sequence numbers.
+    int m_owd_count;
+    double m_owd_sum;
+    long long m_owd_min;
+    long long m_owd_max;
+    int m_err_count;
+    double m_err_sum;
+    double m_err_sumsq;
+};
+
+
+// stamps of one probe stream, kept column-wise: a sequence number, an
+// arrival time (nsecs since the epoch) and a TTL per probe, 13 bytes
+// where a ProbeStamp takes 40.  room for the longest allowed stream is
+// part of the object, so filling one never allocates.
+struct YazStamps
+{
+    YazStamps() : m_stream(0), m_n(0) {}
+
+    int size() const { return m_n; }
+    void clear() { m_n = 0; }
+
+    bool add(const ProbeStamp &ps, long long sent = 0)
+        {
+            if (m_n >= YAZSLABCAP)
+                return false;
+            m_seq[m_n] = ps.m_sequence;
+            m_ns[m_n] = ps.m_ts.tv_sec * 1000000000ULL + ps.m_ts.tv_usec * 1000ULL;
+            m_sent[m_n] = sent;
+            m_ttl[m_n] = (unsigned char)std::min(ps.m_ttl, 255U);
+            m_n++;
+            return true;
+        }
+
+    void copy(const YazStamps &from)
+        {
+            m_stream = from.m_stream;
+            m_n = from.m_n;
+            memcpy(m_seq, from.m_seq, m_n * sizeof(m_seq[0]));
+            memcpy(m_ns, from.m_ns, m_n * sizeof(m_ns[0]));
+            memcpy(m_sent, from.m_sent, m_n * sizeof(m_sent[0]));
+            memcpy(m_ttl, from.m_ttl, m_n * sizeof(m_ttl[0]));
+        }
+
+    // insertion sort across the columns: streams arrive in order, or
+    // nearly so when several lanes sent them.
+    void sortBySequence()
+        {
+            for (int i = 1; i < m_n; ++i)
+            {
+                unsigned int seq = m_seq[i];
+                unsigned long long ns = m_ns[i];
+                long long sent = m_sent[i];
+                unsigned char ttl = m_ttl[i];
+                int j = i;
+                for (; j > 0 && m_seq[j-1] > seq; --j)
+                {
+                    m_seq[j] = m_seq[j-1];
+                    m_ns[j] = m_ns[j-1];
+                    m_sent[j] = m_sent[j-1];
+                    m_ttl[j] = m_ttl[j-1];
+                }
+                m_seq[j] = seq;
+                m_ns[j] = ns;
+                m_sent[j] = sent;
+                m_ttl[j] = ttl;
+            }
+        }
+
+    struct timeval tv(int i) const
+        {
+            struct timeval t;
+            t.tv_sec = m_ns[i] / 1000000000ULL;
+            t.tv_usec = (m_ns[i] % 1000000000ULL) / 1000;
+            return t;
+        }
+
+    unsigned int m_stream;
+    int m_n;
+    unsigned int m_seq[YAZSLABCAP];
+    unsigned long long m_ns[YAZSLABCAP];
+    long long m_sent[YAZSLABCAP];       // departure time from the probe, nsecs, or 0
+    unsigned char m_ttl[YAZSLABCAP];
+};
+
+
+// receive stamps of one probe stream.  a probe past the longest
+// allowed stream is dropped.
+struct YazStreamSlab
+{
+    YazStreamSlab() : m_stream(0), m_used(false), m_touched(0), m_microthresh(0), m_spacing(0) {}
+
+    unsigned int m_stream;
+    bool m_used;
+    long long m_touched;                // now_nsecs() of the last probe
+    float m_microthresh;                // what m_stats was given, for a re-sort
+    int m_spacing;
+    YazStamps m_stamps;                 // in arrival order
+    std::bitset<YAZSLABCAP> m_seen;     // sequence numbers stamped
+    int m_delay[YAZSLABCAP];            // one-way delay by sequence, nsecs
+    YazSpacingStats m_stats;
+};
+
+
+// per-sender state at the receiver.  a session is created for each
+// control connection and is bound to the id that the sender puts in
+// its control messages and probes.  stamps are kept per stream in a
+// fixed number of slabs, so a session never holds more than
+// YAZSLABS * YAZSLABCAP stamps whatever its sender does.
+struct YazSession
+{
+    YazSession() : m_id(0), m_ctrl_sd(-1), m_ctrl_seq(0), m_ctrl_have(0), m_reported(0),
+                   m_have_reported(false), m_late(0), m_dups(0),
+                   m_overflow(0), m_evicted(0), m_busy_until(0) {}
+
+    bool fileStamp(const ProbeStamp &, long long, long long, float, int);
+    void drainStream(unsigned int, YazStamps &, YazSpacingStats &,
+                     std::bitset<YAZSLABCAP> &, std::vector<int> &);
+
+    unsigned int m_id;
+    int m_ctrl_sd;
+    unsigned int m_ctrl_seq;
+    YazCtrlMsg m_ctrl_msg;              // control message being read
+    int m_ctrl_have;                    // ... and how many bytes of it are in
+    YazStreamSlab m_slabs[YAZSLABS];
+    unsigned int m_reported;            // last stream drained by a RST
+    bool m_have_reported;
+
+    unsigned int m_late;                // probes for an already reported stream
+    unsigned int m_dups;                // sequence numbers seen twice
+    unsigned int m_overflow;            // sequence numbers past YAZSLABCAP
+    unsigned int m_evicted;             // streams dropped unreported
+    long long m_busy_until;             // stream expected until (nsecs), or 0
+
+private:
+    YazStreamSlab *newSlab(unsigned int, long long);
+    void releaseSlab(YazStreamSlab *);
+};
+
+
+class YazReceiver;
+
+// one probe socket of the receiver and the sessions whose probes the
+// kernel steers to it.  the mutex is held by the shard's worker while
+// it files a stamp and by the control thread while it binds, drains
+// or drops one of the shard's sessions.
+struct YazShard
+{
+    YazShard() : m_index(0), m_sd(-1), m_cpu(-1), m_running(false),
+                 m_unknown_probes(0), m_gro_batches(0), m_warmups(0), m_rbuf(0), m_recv(0)
+        {
+            m_wake[0] = m_wake[1] = -1;
+            pthread_mutex_init(&m_mutex, NULL);
+        }
+
+    ~YazShard()
+        {
+            pthread_mutex_destroy(&m_mutex);
+        }
+
+    int m_index;
+    int m_sd;
+    int m_cpu;                  // cpu the worker is pinned to, or -1
+    bool m_running;             // worker thread started
+    int m_wake[2];              // pipe the control thread wakes a blocked worker with
+    pthread_t m_thread;
+    pthread_mutex_t m_mutex;
+    std::map<unsigned int, YazSession*> m_sessions;     // by session id
+    unsigned int m_unknown_probes;
+    unsigned int m_gro_batches;     // receives that held more than one probe
+    unsigned int m_warmups;         // warmup probes passed over
+    char *m_rbuf;                   // receive buffer, sized for a GRO batch (arena)
+    YazReceiver *m_recv;
+};
+
+
+#if HAVE_IO_URING
+// a bare io_uring: its two rings, plus provided buffers for receives.
+class YazUring
+{
+public:
+    YazUring();
+    ~YazUring() { close(); }
+
+    bool open(int entries, int verbose);
+    void close();
+
+    struct io_uring_sqe *sqe();
+    int submit(int wait_nr, int timeout);
+    bool cqe(struct io_uring_cqe &);
+
+    bool provide(int group, int nbufs, int buflen);
+    char *buffer(int bid) { return m_bufs + (size_t)bid * m_buflen; }
+    int bufferLen() const { return m_buflen; }
+    void recycle(int bid);
+
+private:
+    int m_fd;
+    void *m_sq_map;
+    size_t m_sq_map_len;
+    void *m_cq_map;
+    size_t m_cq_map_len;
+    struct io_uring_sqe *m_sqes;
+    size_t m_sqes_len;
+    volatile unsigned int *m_sq_head;
+    volatile unsigned int *m_sq_tail;
+    unsigned int *m_sq_array;
+    unsigned int m_sq_mask;
+    unsigned int m_sq_entries;
+    unsigned int m_sq_local;            // tail including unsubmitted entries
+    unsigned int m_to_submit;
+    volatile unsigned int *m_cq_head;
+    volatile unsigned int *m_cq_tail;
+    struct io_uring_cqe *m_cqes;
+    unsigned int m_cq_mask;
+
+    struct io_uring_buf_ring *m_br;
+    size_t m_br_len;
+    int m_group;
+    char *m_bufs;
+    int m_nbufs;
+    int m_buflen;
+    unsigned short m_br_tail;
+};
+
+
+// one datagram from a multishot recvmsg, still in its provided buffer.
+struct YazRingMsg
+{
+    int m_bid;
+    char *m_payload;
+    int m_len;
+    char *m_control;
+    int m_control_len;
+};
+#endif
+
+
+// readiness notification over a changing set of descriptors: epoll
+// where there is one, poll() elsewhere, or io_uring when asked for.
+// on the ring a descriptor can also be given a multishot receive, in
+// which case wait() hands back the datagrams themselves.
+class YazPoller
+{
+public:
+    YazPoller();
+    ~YazPoller();
+
+    void init(bool uring = false, int verbose = 0);
+    void add(int);
+    void remove(int);
+    int wait(std::vector<int> &, int);
+
+#if HAVE_IO_URING
+    bool uring() const { return m_ring != 0; }
+    bool addRecv(int fd, int buflen, int nbufs);
+    bool receiving() const { return m_recv_fd >= 0; }
+    const std::vector<YazRingMsg> &received() const { return m_recvd; }
+    void releaseReceived();
+#endif
+
+private:
+#if HAVE_SYS_EPOLL_H
+    int m_epfd;
+    std::vector<struct epoll_event> m_events;
+#else
+    std::vector<pollfd> m_pfds;
+#endif
+#if HAVE_IO_URING
+    struct io_uring_sqe *ringSqe();
+    void armPoll(int);
+    void disarm(int);
+    void armRecv();
+    int waitRing(std::vector<int> &, int);
+
+    YazUring *m_ring;
+    std::vector<int> m_rearm;           // reported last wait, poll again
+    int m_recv_fd;
+    bool m_recv_armed;
+    struct msghdr m_recv_msg;
+    std::vector<YazRingMsg> m_recvd;
+#endif
 };
 
 
@@ -179,7 +754,7 @@ struct YazPcapCtrl
 
     bool *m_ok;
     pthread_mutex_t *m_mutex;
-    std::vector<ProbeStamp> *m_tlist;
+    YazStampVec *m_tlist;
     unsigned short m_dport;
 #if HAVE_PCAP_H
     pcap_t *m_pcap;
@@ -187,10 +762,354 @@ struct YazPcapCtrl
 };
 
 
+struct YazCalibration
+{
+    YazCalibration() : m_syscall_overhead(0), m_min_sleep(0), m_clock_tick(0) {}
+
+    std::string m_host;
+    std::string m_kernel;
+    std::string m_clocksource;
+    std::string m_cpu;
+
+    int m_syscall_overhead;
+    int m_min_sleep;
+    int m_clock_tick;
+};
+
+struct YazCalibRefresh;
+
+
+// two-sided page-hinkley test on a series of estimates.  deviations
+// are taken relative to the running mean of the series so that
+// the thresholds are unitless.
+class YazChangeDetector
+{
+public:
+    YazChangeDetector(float delta = 0.05, float lambda = 0.5) :
+        m_delta(delta), m_lambda(lambda) { reset(); }
+
+    void reset()
+        {
+            m_n = 0;
+            m_mean = 0.0;
+            m_cum_up = m_min_up = 0.0;
+            m_cum_down = m_max_down = 0.0;
+        }
+
+    bool update(float, float floor = 1.0);
+
+private:
+    float m_delta;
+    float m_lambda;
+    int m_n;
+    double m_mean;
+    double m_cum_up;
+    double m_min_up;
+    double m_cum_down;
+    double m_max_down;
+};
+
+
+// PsVec reports of per-probe stamps.  the messages live on an arena
+// that starts in a block of our own and is reset for each report, so
+// once the block is big enough encoding or decoding a report doesn't
+// touch the heap.  (clearing a message on an arena drops its
+// Timestamps rather than reusing them; resetting the arena is what
+// keeps it from growing.)  a copy gets an arena of its own.
+class YazPsVecCodec
+{
+public:
+    YazPsVecCodec();
+    YazPsVecCodec(const YazPsVecCodec &);
+    YazPsVecCodec &operator=(const YazPsVecCodec &) { return *this; }
+
+    void encode(const YazStamps &, std::string &);
+    bool decode(const char *, int, YazStamps &);
+
+private:
+    PsVec::SendProbeStampVec *fresh();
+
+    std::vector<char> m_block;          // first arena block
+    google::protobuf::Arena m_arena;
+};
+
+
+// what the kernel saw of a probe socket's sends: transmit timestamps
+// from the error queue (SO_TIMESTAMPING) and the bytes still queued
+// below the socket (SIOCOUTQ).  opening it also turns on IP_RECVERR,
+// so that a probe the qdisc drops fails its send with ENOBUFS rather
+// than disappearing.
+class YazTxWatch
+{
+public:
+    YazTxWatch() : m_sd(-1), m_stamping(false) {}
+
+    bool open(int sd, int verbose);
+    bool stamping() const { return m_stamping; }
+    int outq();
+    void discard();
+    int collect(long long *, int, int);
+
+private:
+    int next(long long &);
+
+    int m_sd;
+    bool m_stamping;
+};
+
+
+class YazSender;
+
+// one sending thread.  with more than one lane a stream is split by
+// sequence number (lane i sends i, i+n, i+2n, ...) against a start
+// time shared by all lanes, so that the receiver sees a single stream
+// at the aggregate rate.
+struct YazPacerLane
+{
+    YazPacerLane() : m_index(0), m_cpu(-1), m_sd(-1), m_buf(0), m_done(0), m_sender(0),
+                     m_tx(0), m_ntx(0), m_outq(0) {}
+
+    int m_index;
+    int m_cpu;                  // cpu to pin to, or -1
+    int m_sd;                   // lane 0 uses the sender's probe socket
+    char *m_buf;                // prefaulted probe payload
+    int m_done;                 // last stream request completed
+    pthread_t m_thread;
+    YazStampVec m_stamps;
+    YazSender *m_sender;
+    YazTxWatch m_watch;
+    long long *m_tx;            // transmit times of the last stream, nsecs
+    int m_ntx;
+    int m_outq;                 // bytes still queued when it was sent
+};
+
+
+struct YazPacerCtrl
+{
+    YazPacerCtrl() : m_requested(0), m_completed(0), m_exit(false), m_failed(false), m_late(false), m_recalibrating(false),
+                     m_lanes_done(0), m_start(0), m_abort(false)
+        {
+            pthread_mutex_init(&m_mutex, NULL);
+            pthread_cond_init(&m_cond, NULL);
+        }
+
+    ~YazPacerCtrl()
+        {
+            pthread_cond_destroy(&m_cond);
+            pthread_mutex_destroy(&m_mutex);
+        }
+
+    std::vector<YazPacerLane*> m_lanes;
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_cond;
+    int m_requested;        // streams asked for by the control thread
+    int m_completed;        // streams sent by all the lanes
+    bool m_exit;
+    bool m_failed;
+    bool m_late;            // the stream fell a whole gap behind its schedule
+    bool m_recalibrating;   // lane 0 is recalibrating, between streams
+    int m_lanes_done;       // lanes finished with the current stream
+    long long m_start;      // now_nsecs() deadline of sequence 0, multi-lane
+    volatile bool m_abort;      // a lane gave up on the current stream
+};
+
+
+#if HAVE_FRAME_TX
+// a sender backend that puts complete ethernet/ip/udp probe frames on
+// the wire itself.  the headers are built once per stream from the
+// route to the target and the 5-tuple of the sender's connected probe
+// socket, so the receiver can't tell these probes from ordinary ones;
+// only the sequence number and departure time are written per probe.
+class YazFrameTx
+{
+public:
+    YazFrameTx() : m_paylen(-1)
+        {
+            memset(m_src_mac, 0, ETH_ALEN);
+            memset(m_dst_mac, 0, ETH_ALEN);
+        }
+    virtual ~YazFrameTx() {}
+
+    virtual bool prepStream(int paylen, unsigned int session, int stream, int spacing_ns) = 0;
+    virtual void fill(int seq, long long sent) = 0;
+    virtual bool kick() = 0;
+
+protected:
+    bool findPath(int probe_sd, std::string &dev);
+    int buildFrame(char *data, int paylen);
+    void stampFrame(char *data, unsigned int session, int stream, int spacing_ns);
+    void seqFrame(char *data, int seq, long long sent);
+
+    unsigned char m_src_mac[ETH_ALEN];
+    unsigned char m_dst_mac[ETH_ALEN];
+    struct sockaddr_in m_src;
+    struct sockaddr_in m_dst;
+    int m_paylen;               // payload length the frames are built for
+};
+#endif
+
+
+#if HAVE_PACKET_TX_RING
+// probe frames in a PACKET_TX_RING.
+class YazTxRing : public YazFrameTx
+{
+public:
+    YazTxRing() : YazFrameTx(), m_sd(-1), m_ring(0), m_ring_len(0), m_frame_size(0), m_nframes(0) {}
+    ~YazTxRing() { close(); }
+
+    bool open(int probe_sd, int nframes, int maxlen, bool bypass, int verbose);
+    void close();
+    virtual bool prepStream(int paylen, unsigned int session, int stream, int spacing_ns);
+    virtual void fill(int seq, long long sent);
+    virtual bool kick();
+
+private:
+    struct tpacket2_hdr *frame(int i) { return (struct tpacket2_hdr*)(m_ring + (size_t)i * m_frame_size); }
+    char *frameData(int i) { return ((char *)frame(i)) + TPACKET_ALIGN(sizeof(struct tpacket2_hdr)); }
+
+    int m_sd;
+    char *m_ring;
+    size_t m_ring_len;
+    int m_frame_size;
+    int m_nframes;
+};
+#endif
+
+
+#if HAVE_AF_XDP
+// one of the four rings an AF_XDP socket shares with the kernel.
+struct YazXskRing
+{
+    YazXskRing() : m_producer(0), m_consumer(0), m_flags(0), m_desc(0), m_map(0), m_map_len(0) {}
+
+    volatile unsigned int *m_producer;
+    volatile unsigned int *m_consumer;
+    volatile unsigned int *m_flags;
+    void *m_desc;
+    void *m_map;
+    size_t m_map_len;
+};
+
+
+// an AF_XDP socket on one queue of an interface, with a umem of its
+// own.  the first YAZXSKRING frames of the umem are for receiving and
+// the next YAZXSKRING for transmitting.
+class YazXsk
+{
+public:
+    YazXsk() : m_sd(-1), m_umem(0), m_umem_len(0), m_zerocopy(false), m_outstanding(0) {}
+    ~YazXsk() { close(); }
+
+    bool open(int ifindex, int queue, bool rx, bool tx, int verbose);
+    void close();
+    int fd() const { return m_sd; }
+    char *frame(unsigned long long addr) { return m_umem + addr; }
+    unsigned long long txFrame(int i) const { return (unsigned long long)(YAZXSKRING + i) * YAZXSKFRAMESIZE; }
+
+    bool txPost(unsigned long long addr, int len);
+    bool txKick();
+    int txReap();
+    int rxPeek(struct xdp_desc *, int);
+    void rxRelease(const struct xdp_desc *, int);
+    long long rxStamp(const struct xdp_desc &);
+
+private:
+    bool mapRing(YazXskRing &, const struct xdp_ring_offset &, off_t, size_t);
+    void unmapRing(YazXskRing &);
+
+    int m_sd;
+    char *m_umem;
+    size_t m_umem_len;
+    bool m_zerocopy;
+    int m_outstanding;          // tx descriptors not yet completed
+    YazXskRing m_fill;
+    YazXskRing m_comp;
+    YazXskRing m_rx;
+    YazXskRing m_tx;
+};
+
+
+// probe frames in the tx half of an AF_XDP umem.
+class YazXskTx : public YazFrameTx
+{
+public:
+    YazXskTx() : YazFrameTx(), m_nframes(0), m_frame_len(0) {}
+
+    bool open(int probe_sd, int nframes, int verbose);
+    virtual bool prepStream(int paylen, unsigned int session, int stream, int spacing_ns);
+    virtual void fill(int seq, long long sent);
+    virtual bool kick();
+
+private:
+    YazXsk m_xsk;
+    int m_nframes;
+    int m_frame_len;
+};
+
+
+// an xdp program that redirects udp probes for one port to AF_XDP
+// sockets (one per rx queue) and stamps each with bpf_ktime_get_ns()
+// in the packet metadata.  everything else is passed to the stack.
+class YazXdpSteer
+{
+public:
+    YazXdpSteer() : m_map_fd(-1), m_prog_fd(-1), m_link_fd(-1) {}
+    ~YazXdpSteer() { detach(); }
+
+    bool attach(int ifindex, unsigned short port, int nqueues, int verbose);
+    bool add(int queue, int xsk_fd);
+    void detach();
+
+private:
+    int m_map_fd;
+    int m_prog_fd;
+    int m_link_fd;
+};
+
+int xdp_rx_queues(const std::string &);
+
+#if HAVE_PROBE_TAP
+// one probe as recorded by the probe tap: the probe header as it came
+// off the wire (network byte order), its ttl and a bpf_ktime_get_ns()
+// arrival stamp.
+struct YazTapRecord
+{
+    unsigned long long m_ktime;
+    YazPkt m_pkt;
+    unsigned int m_ttl;
+    unsigned int m_pad;
+};
+
+
+// an xdp program that records each udp probe for one port into a bpf
+// ring buffer and then passes the probe on to the stack or drops it.
+// the receiver reads the records instead of the packets.
+class YazProbeTap
+{
+public:
+    YazProbeTap() : m_map_fd(-1), m_prog_fd(-1), m_link_fd(-1), m_consumer(0), m_producer(0) {}
+    ~YazProbeTap() { detach(); }
+
+    bool attach(int ifindex, unsigned short port, bool drop, int verbose);
+    void detach();
+    int fd() { return m_map_fd; }
+    int read(YazTapRecord *out, int max);
+
+private:
+    int m_map_fd;
+    int m_prog_fd;
+    int m_link_fd;
+    volatile unsigned long *m_consumer;     // our page, read-write
+    volatile unsigned long *m_producer;     // kernel page, records follow
+};
+#endif
+#endif
+
+
 class YazEndPt
 {
 public:
-    YazEndPt() : m_verbose(0), m_ctrl_seq(0), m_ctrl_dest(DEST_CTRL_PORT), m_probe_dest(DEST_PORT), m_ctrl_sd(0), m_probe_sd(0), m_syscall_overhead(0), m_min_sleep(0)
+    YazEndPt() : m_verbose(0), m_ctrl_seq(0), m_ctrl_dest(DEST_CTRL_PORT), m_probe_dest(DEST_PORT), m_ctrl_sd(0), m_probe_sd(0), m_syscall_overhead(0), m_min_sleep(0), m_clock_tick(100), m_smooth_overhead(0), m_smooth_min_sleep(0), m_recal_interval(YAZRECALINTERVAL), m_streams_since_recal(0), m_uring(false), m_refresh(0)
 #if HAVE_PCAP_H
                ,m_using_pcap(true), m_pcap_thread(0), m_running(0), m_pcap(0)
 #endif
@@ -198,7 +1117,7 @@ public:
             m_app_probes.clear();
 
 #if HAVE_PCAP_H
-            m_pcap_probes = new std::vector<ProbeStamp>();
+            m_pcap_probes = new YazStampVec();
             if (!m_pcap_probes)
             { 
                 std::cerr << "!!couldn't allocate probe stamp vector" << std::endl;
@@ -246,6 +1165,9 @@ public:
 #if HAVE_PCAP_H
     void setPcapDev(std::string &s) { m_pcap_dev = s; }
 #endif
+    void setCalibFile(std::string &s) { m_calib_file = s; }
+    void setRecalInterval(int &i) { m_recal_interval = i; }
+    void setUring(bool &b) { m_uring = b; }
 
     virtual void prepCtrl() = 0;
     virtual void prepProbe() = 0;
@@ -256,14 +1178,17 @@ public:
     #endif
 
 protected:
+    void calibrate();
+    void finishCalibration();
     void measureSyscallOverhead();
     void measureMinSleep();
+    void recalibrate(bool with_sleep);
     void getClockTick();
 #if 0
-    bool isValidStream(std::vector<ProbeStamp> *, int min_hint = 0);
+    bool isValidStream(YazStampVec *, int min_hint = 0);
 #endif
-    bool getSpacing(std::vector<ProbeStamp> *, float &, int &, int &, int min_hint = 0);
-    bool checkTTL(std::vector<ProbeStamp> *, unsigned int &);
+    bool getSpacing(YazStampVec *, float &, int &, int &, int min_hint = 0);
+    bool checkTTL(YazStampVec *, unsigned int &);
 
     int m_verbose;
     unsigned int m_ctrl_seq;
@@ -272,18 +1197,28 @@ protected:
     int m_ctrl_sd;
     int m_probe_sd;
 
-    std::vector<ProbeStamp> m_app_probes;
+    YazArena m_arena;                   // per-stream buffers; outlives m_app_probes
+    YazStampVec m_app_probes;
     int m_syscall_overhead;
     int m_min_sleep;
 
     int m_clock_tick;
+    std::string m_calib_file;
+
+    double m_smooth_overhead;           // ewma of clock read cost, usecs
+    double m_smooth_min_sleep;          // ewma of sleep threshold, usecs
+    int m_recal_interval;               // streams between recalibrations
+    int m_streams_since_recal;
+    bool m_uring;                       // io_uring I/O engine
+    YazCalibRefresh *m_refresh;         // background recalibration, until joined
+    YazPsVecCodec m_psvec;              // stamp reports (PREPORT_STAMPS)
 
 #if HAVE_PCAP_H
     bool m_using_pcap;
     pthread_t *m_pcap_thread;
     bool *m_running;
     pcap_t *m_pcap;
-    std::vector<ProbeStamp> *m_pcap_probes;
+    YazStampVec *m_pcap_probes;
     pthread_mutex_t *m_pcap_mutex;
     std::string m_pcap_filter_string;
     char m_pcap_err[PCAP_ERRBUF_SIZE];
@@ -300,8 +1235,23 @@ public:
                   m_stream_length(50), m_target_spacing(MIN_SPACE), 
                   m_max_pkt_spacing(MAX_SPACE), m_nstreams(1),
                   m_inter_stream_spacing(20000), m_curr_stream(0),
-                  m_resolution(1000000.0), m_curr_estimation(0),
-                  m_traffic_generated(0)
+                  m_resolution(1000000.0), m_max_backoff(MAX_BACKOFF),
+                  m_backoff(1), m_pacing_corr(0), m_realtime(false),
+                  m_pacer_cpu(-1), m_pacer(0), m_probe_buf(0), m_probe_buf_len(0),
+                  m_session(0), m_report_level(PREPORT_DELAYS),
+                  m_round_report(PREPORT_DELAYS), m_round_losses(false),
+                  m_remote_seen_len(0), m_gso(false), m_nlanes(1),
+                  m_tx_mode(PTX_SOCKET),
+#if HAVE_FRAME_TX
+                  m_txring(0),
+#endif
+#if HAVE_IO_URING
+                  m_ring(0), m_ring_buf(0),
+#endif
+                  m_announce(true), m_warmup(0), m_pm_qos(false), m_pm_qos_fd(-1),
+                  m_tx_drops(0), m_local_tx(0), m_local_sent(0), m_local_resent(0),
+                  m_local_kept(0), m_local_discarded(0), m_round_kept_bad(0),
+                  m_curr_estimation(0), m_estimated(false), m_traffic_generated(0)
         {
             memset(&m_target_addr, 0, sizeof(struct in_addr));
             inet_pton(AF_INET, "127.0.0.1", &m_target_addr);
@@ -335,10 +1285,10 @@ public:
             rv = rv && (m_probe_dest > 1023);
             if (m_verbose && !rv)
                 std::cout << "## bad dest probe port" << std::endl;
-            rv = rv && (m_min_pkt_size >= 28 && m_min_pkt_size <= 1500);
+            rv = rv && (m_min_pkt_size >= int(sizeof(struct ip) + sizeof(struct udphdr) + sizeof(YazPkt)) && m_min_pkt_size <= 1500);
             if (m_verbose && !rv)
                 std::cout << "## bad min pkt size" << std::endl;
-            rv = rv && (m_stream_length > 1 && m_stream_length <= 250);
+            rv = rv && (m_stream_length > 1 && m_stream_length <= YAZSLABCAP);
             if (m_verbose && !rv)
                 std::cout << "## bad stream length" << std::endl;
             rv = rv && (m_nstreams >= 1 && m_nstreams <= 5);
@@ -347,10 +1297,79 @@ public:
             rv = rv && (m_inter_stream_spacing >= 10000 && m_inter_stream_spacing <= 1000000);
             if (m_verbose && !rv)
                 std::cout << "## bad inter-stream spacing" << std::endl;
+            rv = rv && (m_max_backoff >= 1 && m_max_backoff <= 1024);
+            if (m_verbose && !rv)
+                std::cout << "## bad maximum estimation back-off" << std::endl;
+            rv = rv && (m_report_level >= PREPORT_SUMMARY && m_report_level <= PREPORT_DELAYS);
+            if (m_verbose && !rv)
+                std::cout << "## bad receiver report level" << std::endl;
+            rv = rv && (m_nlanes >= 1 && m_nlanes <= PACER_MAX_LANES);
+            if (m_verbose && !rv)
+                std::cout << "## bad number of sending threads" << std::endl;
+            if (rv && m_gso && m_nlanes > 1)
+            {
+                std::cerr << "!! (non-fatal) high-rate mode sends from one thread - ignoring extra sending threads" << std::endl;
+                m_nlanes = 1;
+            }
+#if HAVE_SYSCONF
+            if (rv && m_nlanes > sysconf(_SC_NPROCESSORS_ONLN))
+            {
+                // spinning lanes sharing a cpu only get in each other's way.
+                m_nlanes = std::max(1, int(sysconf(_SC_NPROCESSORS_ONLN)));
+                std::cerr << "!! (non-fatal) more sending threads than cpus - using " << m_nlanes << std::endl;
+            }
+#endif
+#if !HAVE_UDP_GSO
+            if (m_gso)
+            {
+                std::cerr << "!! (non-fatal) no UDP segmentation offload on this platform - high-rate mode disabled" << std::endl;
+                m_gso = false;
+            }
+#endif
+            rv = rv && (m_warmup >= 0 && m_warmup <= YAZMAXWARMUP);
+            if (m_verbose && !rv)
+                std::cout << "## bad number of warmup probes" << std::endl;
+            rv = rv && (m_tx_mode >= PTX_SOCKET && m_tx_mode <= PTX_XDP);
+            if (m_verbose && !rv)
+                std::cout << "## bad probe transmit mode" << std::endl;
+#if !HAVE_PACKET_TX_RING
+            if (rv && (m_tx_mode == PTX_RING || m_tx_mode == PTX_RING_BYPASS))
+            {
+                std::cerr << "!! (non-fatal) no PACKET_TX_RING on this platform - sending probes through udp socket" << std::endl;
+                m_tx_mode = PTX_SOCKET;
+            }
+#endif
+#if !HAVE_AF_XDP
+            if (rv && m_tx_mode == PTX_XDP)
+            {
+                std::cerr << "!! (non-fatal) no AF_XDP on this platform - sending probes through udp socket" << std::endl;
+                m_tx_mode = PTX_SOCKET;
+            }
+#endif
+            if (rv && m_tx_mode != PTX_SOCKET && m_nlanes > 1)
+            {
+                std::cerr << "!! (non-fatal) probe frames are fed from one thread - ignoring extra sending threads" << std::endl;
+                m_nlanes = 1;
+            }
+#if !HAVE_IO_URING
+            if (m_uring)
+            {
+                std::cerr << "!! (non-fatal) no io_uring on this platform - using the default I/O engine" << std::endl;
+                m_uring = false;
+            }
+#endif
+            if (rv && m_uring && (m_gso || m_tx_mode != PTX_SOCKET))
+            {
+                std::cerr << "!! (non-fatal) io_uring only paces udp socket sends - not used with -G or -E" << std::endl;
+                m_uring = false;
+            }
+            if (rv && m_uring && m_nlanes > 1)
+            {
+                std::cerr << "!! (non-fatal) io_uring paces a whole stream from one thread - ignoring extra sending threads" << std::endl;
+                m_nlanes = 1;
+            }
 
-            measureSyscallOverhead();
-            measureMinSleep();
-            getClockTick();
+            calibrate();
             m_max_pkt_spacing = 1000000 / m_clock_tick / 2;
             m_inter_stream_spacing = std::max(m_inter_stream_spacing, m_clock_tick * 2);
 
@@ -376,6 +1395,22 @@ public:
                 std::cout << "##resolution: " << m_resolution << std::endl;
                 std::cout << "##streams: " << m_nstreams << std::endl;
                 std::cout << "##inter-stream spacing: " << m_inter_stream_spacing << std::endl;
+                std::cout << "##max estimation back-off: " << m_max_backoff << std::endl;
+                std::cout << "##receiver report level: " << m_report_level << std::endl;
+                if (m_nlanes > 1)
+                    std::cout << "##sending threads per stream: " << m_nlanes << std::endl;
+                if (m_gso)
+                    std::cout << "##high-rate mode: UDP_SEGMENT trains, min spacing " << MIN_SPACE_GSO << std::endl;
+                if (m_tx_mode == PTX_XDP)
+                    std::cout << "##probes sent from AF_XDP socket" << std::endl;
+                else if (m_tx_mode != PTX_SOCKET)
+                    std::cout << "##probes sent from PACKET_TX_RING" << (m_tx_mode == PTX_RING_BYPASS ? ", bypassing qdisc" : "") << std::endl;
+                if (m_uring)
+                    std::cout << "##probes paced and sent through io_uring" << std::endl;
+                if (m_warmup)
+                    std::cout << "##warmup probes per stream: " << m_warmup << std::endl;
+                if (m_pm_qos)
+                    std::cout << "##holding a cpu latency request during streams" << std::endl;
                 if (m_verbose > 1)
                     std::cout << "##syscall overhead: " << m_syscall_overhead << std::endl;
             }
@@ -394,6 +1429,15 @@ public:
     void setResolution(float &f) { m_resolution = f; }
     void setInitialSpacing(int &i) { m_target_spacing = i; }
     void setInitialPktSize(int &i) { m_curr_pkt_size = i; }
+    void setMaxBackoff(int &i) { m_max_backoff = i; }
+    void setRealtime(bool &b) { m_realtime = b; }
+    void setPacerCpu(int &i) { m_pacer_cpu = i; }
+    void setReportLevel(int &i) { m_report_level = m_round_report = i; }
+    void setHighRate(bool &b) { m_gso = b; }
+    void setLanes(int &i) { m_nlanes = i; }
+    void setTxMode(int &i) { m_tx_mode = i; }
+    void setWarmup(int &i) { m_warmup = i; }
+    void setPmQos(bool &b) { m_pm_qos = b; }
 
     float get_current_estimation() const{ return m_curr_estimation;}
     int get_current_pkt_size() const{ return m_curr_pkt_size; }
@@ -412,18 +1456,45 @@ public:
     virtual void resetRound();
     virtual bool doOneMeasurementRound(std::list<MeasurementBundle> *);
     virtual bool processOneRoundRes(std::list<MeasurementBundle> *);
+
+    void pacerLoop(YazPacerLane *);
 protected:
     virtual void prepCtrl();
     virtual void prepProbe();
     bool resetRemote();
     bool collectRemote(MeasurementBundle &);
+    void announceStream();
     bool isPathSame(std::list<MeasurementBundle> *);
     bool localSpacingConsistent(std::list<MeasurementBundle> *);
+    bool localStreamConsistent();
+    bool perProbeSends();
+    int lanePlanned(YazPacerLane *);
     void coalesceMeasurements(std::list<MeasurementBundle> *, MeasurementBundle &);
+    void startPacer();
+    void stopPacer();
+    void runStream();
     void sendStream();
-    void sendProbe(char *, int, int, int);
-    void sleepExponentially();
-    std::vector<timeval> make_delays_vec(const std::vector<ProbeStamp>&);
+    void sendStreamGso(int);
+    void prepTxRing();
+#if HAVE_FRAME_TX
+    void sendStreamRing();
+#endif
+    void prepUring();
+    size_t arenaSize();
+    void sendWarmup(int, char *, int);
+    void holdLatency();
+    void releaseLatency();
+#if HAVE_IO_URING
+    void sendStreamUring(int);
+#endif
+    void sendLane(YazPacerLane *, long long);
+    int openProbeSocket();
+    int minSpace() const { return m_gso ? MIN_SPACE_GSO : MIN_SPACE; }
+    void sendProbe(int, char *, int, int, int, long long);
+    void newSession();
+    void sleepExponentially(int scale = 1);
+    void adaptEstimationInterval();
+    void make_delays_vec(const YazStamps&, std::vector<timeval>&);
 private:
     struct in_addr m_target_addr;
     int m_min_pkt_size;
@@ -435,8 +1506,52 @@ private:
     int m_inter_stream_spacing;
     int m_curr_stream;
     float m_resolution;
+    int m_max_backoff;                  // cap on inter-estimate back-off
+    int m_backoff;                      // current inter-estimate multiplier
+    YazChangeDetector m_change;
+    double m_pacing_corr;               // usecs trimmed from target spacing
+    std::vector<int> m_gaps;            // departure gaps of the last stream
+    bool m_realtime;                    // run pacing thread SCHED_FIFO
+    int m_pacer_cpu;                    // cpu to pin pacing thread to, or -1
+    YazPacerCtrl *m_pacer;
+    char *m_probe_buf;                  // prefaulted probe payload
+    int m_probe_buf_len;
+    unsigned int m_session;             // our session id at the receiver
+    int m_report_level;                 // PREPORT_* wanted from the receiver
+    int m_round_report;                 // level asked for this round
+    bool m_round_losses;                // receiver reported losses this round
+    std::bitset<YAZSLABCAP> m_remote_seen;  // last loss bitmap
+    int m_remote_seen_len;              // sequence numbers it covers
+    YazStamps m_remote_probes;          // last stamp report
+    YazRstResponse m_rst_reply;         // last RST-ACK summary
+    std::vector<char> m_report_buf;     // and its report
+    MeasurementBundle m_stream_mb;      // stream being collected
+    MeasurementBundle m_round_mb;       // streams of a round, coalesced
+    std::list<MeasurementBundle> m_spare_mbs;   // bundles to reuse
+    bool m_gso;                         // high-rate mode: UDP_SEGMENT trains
+    int m_nlanes;                       // sending threads per stream
+    int m_tx_mode;                      // PTX_*
+#if HAVE_FRAME_TX
+    YazFrameTx *m_txring;               // PACKET_TX_RING or AF_XDP
+#endif
+#if HAVE_IO_URING
+    YazUring *m_ring;                   // io_uring pacing, or 0
+    char *m_ring_buf;                   // a probe payload per send in flight
+#endif
+    bool m_announce;                    // receiver takes PCTRL_STREAM notices
+    int m_warmup;                       // untimed probes ahead of each stream
+    bool m_pm_qos;                      // hold a cpu latency request during streams
+    int m_pm_qos_fd;                    // open while the request is held
+    volatile int m_tx_drops;            // probes of this stream the qdisc dropped
+    long long *m_local_tx;              // all lanes' transmit times, nsecs
+    int m_local_sent;                   // streams sent
+    int m_local_resent;                 // of them, resent for bad local spacing
+    int m_local_kept;                   // kept badly spaced after YAZLOCALRESENDS
+    int m_local_discarded;              // rounds not estimated from because of them
+    int m_round_kept_bad;               // such streams in this round
 
     float m_curr_estimation;            // bytes/sec (?)
+    bool m_estimated;                   // this sample converged on an estimate
     unsigned int m_traffic_generated;   // bytes, for last round
     int _m_max_space;
     int _m_fastest_local;
@@ -449,7 +1564,17 @@ class YazReceiver : public ABReceiver,
                     public YazEndPt
 {
 public:    
-    YazReceiver(): YazEndPt(), m_high_accuracy(true) {}
+    YazReceiver(): YazEndPt(), m_high_accuracy(true), m_nshards(1), m_gro(false), m_xdp_dev(""),
+                   m_tap_dev(""), m_tap_drop(false), m_busy_poll(0), m_busy_until(0), m_busy(false)
+#if HAVE_AF_XDP
+                  , m_steer(0)
+#endif
+#if HAVE_PROBE_TAP
+                  , m_tap(0)
+#endif
+        {
+            m_drained_delays.reserve(YAZSLABCAP);
+        }
     //virtual ~YazReceiver() {}
 
     virtual void run();
@@ -465,10 +1590,90 @@ public:
                 std::cerr << "!!error validating specified receiver ports" << std::endl;
             }
 
-            if (rv && m_verbose)
+#if !HAVE_UDP_GSO
+            if (m_gro)
+            {
+                std::cerr << "!! (non-fatal) no UDP GRO on this platform - receiving probes one by one" << std::endl;
+                m_gro = false;
+            }
+#endif
+
+            if (rv && (m_nshards < 1 || m_nshards > YAZMAXSHARDS))
+            {
+                std::cerr << "!!number of receive shards must be between 1 and " << YAZMAXSHARDS << std::endl;
+                rv = false;
+            }
+
+#if !HAVE_AF_XDP
+            if (m_xdp_dev != "")
             {
+                std::cerr << "!! (non-fatal) no AF_XDP on this platform - receiving probes through udp socket" << std::endl;
+                m_xdp_dev = "";
+            }
+#endif
+#if !HAVE_PROBE_TAP
+            if (m_tap_dev != "")
+            {
+                std::cerr << "!! (non-fatal) no bpf ring buffer on this platform - receiving probes through udp socket" << std::endl;
+                m_tap_dev = "";
+            }
+#endif
+            if (m_tap_dev != "" && m_xdp_dev != "")
+            {
+                std::cerr << "!! (non-fatal) probe tap and AF_XDP capture both need the xdp hook - using the probe tap" << std::endl;
+                m_xdp_dev = "";
+            }
+            if (rv && m_tap_dev != "" && m_nshards > 1)
+            {
+                std::cerr << "!! (non-fatal) probe tap records are read on the main thread - using a single receive shard" << std::endl;
+                m_nshards = 1;
+            }
+#if !HAVE_IO_URING
+            if (m_uring)
+            {
+                std::cerr << "!! (non-fatal) no io_uring on this platform - using the default I/O engine" << std::endl;
+                m_uring = false;
+            }
+#endif
+            if (rv && m_uring && m_nshards > 1)
+            {
+                std::cerr << "!! (non-fatal) io_uring probes are read on the main thread - using a single receive shard" << std::endl;
+                m_nshards = 1;
+            }
+            if (rv && m_xdp_dev != "" && m_nshards > 1)
+            {
+                std::cerr << "!! (non-fatal) AF_XDP probes are read on the main thread - using a single receive shard" << std::endl;
+                m_nshards = 1;
+            }
+
+#if !HAVE_REUSEPORT_CBPF
+            if (rv && m_nshards > 1)
+            {
+                std::cerr << "!! (non-fatal) no SO_REUSEPORT steering on this platform - using a single receive shard" << std::endl;
+                m_nshards = 1;
+            }
+#endif
+
+            if (rv && m_busy_poll < 0)
+            {
+                std::cerr << "!!busy-poll time must not be negative" << std::endl;
+                rv = false;
+            }
+#if !HAVE_SO_BUSY_POLL
+            if (m_busy_poll > 0)
+                std::cerr << "!! (non-fatal) no SO_BUSY_POLL on this platform - spinning during streams without kernel busy polling" << std::endl;
+#endif
+
+            if (rv)
+            {
+                // needed for stamp correction and spacing thresholds
+                // even when quiet.
                 measureSyscallOverhead();
                 getClockTick();
+            }
+
+            if (rv && m_verbose)
+            {
 
                 struct timeval tv;
                 gettimeofday(&tv, 0);
@@ -481,6 +1686,16 @@ public:
                 std::cout << "##yaz receiver ok - started at " << buf << '.' << std::setw(6) << std::setfill('0') << tv.tv_usec << std::endl;
                 std::cout << "##control port: " << m_ctrl_dest << std::endl;
                 std::cout << "##probe port: " << m_probe_dest << std::endl;
+                if (m_nshards > 1)
+                    std::cout << "##receive shards: " << m_nshards << std::endl;
+                if (m_xdp_dev != "")
+                    std::cout << "##AF_XDP probe capture on " << m_xdp_dev << std::endl;
+                if (m_uring)
+                    std::cout << "##io_uring I/O engine" << std::endl;
+                if (m_tap_dev != "")
+                    std::cout << "##kernel probe tap on " << m_tap_dev << (m_tap_drop ? " (dropping probes)" : "") << std::endl;
+                if (m_busy_poll > 0)
+                    std::cout << "##busy-polling " << m_busy_poll << " usecs during streams, blocking between them" << std::endl;
 
                 if (m_verbose > 1)
                     std::cout << "##syscall overhead: " << m_syscall_overhead << std::endl;
@@ -496,21 +1711,87 @@ public:
     void setAccuracy(bool is_high_accuracy){
         m_high_accuracy = is_high_accuracy;
     }
+    void setShards(int &i) { m_nshards = i; }
+    void setGro(bool &b) { m_gro = b; }
+    void setXdp(std::string &s) { m_xdp_dev = s; }
+    void setTap(std::string &s, bool &drop) { m_tap_dev = s; m_tap_drop = drop; }
+    void setBusyPoll(int &i) { m_busy_poll = i; }
+
+    void shardLoop(YazShard *);
 protected:
     virtual void prepCtrl();
     virtual void prepProbe();
     virtual void cleanup();
 
 private:
-    void getConnection(int &, bool &);
-    void processControlMessage(int, bool &);
-    void processProbe();
+    void acceptConnection();
+    void closeSession(YazSession *);
+    void processControlMessage(YazSession *);
+    void buildReport(YazCtrlMsg &);
+    void processProbe(YazShard *, int flags = 0);
+    void fileProbe(YazShard *, const char *, ssize_t, const struct timeval &, unsigned int ttl = 0);
+#if HAVE_AF_XDP
+    void prepXdp();
+    void processXsk(YazShard *, YazXsk *);
+#endif
+#if HAVE_PROBE_TAP
+    void prepTap();
+    void processTap(YazShard *);
+#endif
+#if HAVE_IO_URING
+    void processRing(YazShard *);
+#endif
+    void startShards();
+    void stopShards();
+    void expectStream(YazSession *, long long);
+    bool busyPolling();
+    void setBusy(bool);
+    YazShard *shardFor(unsigned int id) { return m_shards[id % m_shards.size()]; }
+#if HAVE_PCAP_H
+    size_t countPcapProbes(unsigned int);
+#endif
 
     bool m_high_accuracy;   // increase accuracy but cause high load on CPU
+    int m_nshards;          // probe sockets (and workers if > 1)
+    bool m_gro;             // let the kernel coalesce probes (UDP_GRO)
+    std::string m_xdp_dev;  // interface to capture probes on with AF_XDP
+    std::string m_tap_dev;  // interface to record probes on in the kernel
+    bool m_tap_drop;        // drop probes once the tap has recorded them
+    int m_busy_poll;        // busy-poll usecs while a stream is expected, or 0
+    long long m_busy_until; // latest m_busy_until of any session (nsecs)
+    volatile bool m_busy;   // busy-polling now; read by the shard workers
+#if HAVE_AF_XDP
+    YazXdpSteer *m_steer;
+    std::vector<YazXsk*> m_xsks;                    // by rx queue
+#endif
+#if HAVE_PROBE_TAP
+    YazProbeTap *m_tap;
+#endif
+
+    YazPoller m_poller;
+    std::vector<int> m_ready;
+    std::map<int, YazSession*> m_conns;             // by control socket
+    std::vector<YazShard*> m_shards;
+    YazStamps m_drained;                            // stamps being reported
+    YazSpacingStats m_drained_stats;
+    std::bitset<YAZSLABCAP> m_drained_seen;
+    std::vector<int> m_drained_delays;              // by sequence, nsecs
+    YazRstResponse m_reply_rst;                     // RST-ACK summary being sent
+    std::string m_reply_extra;                      // its report, reused
 };
 
 
-PsVec::SendProbeStampVec serialize_psvec(const std::vector<ProbeStamp>& ps_vec);
-std::vector<ProbeStamp> deserialize_psvec(const PsVec::SendProbeStampVec& ps_vec);
+double measure_syscall_overhead(int nsamples, int verbose);
+double measure_min_sleep(int nsamples, int verbose);
+void set_timer_slack(int verbose);
+bool send_iov(int, struct iovec *, int);
+#if HAVE_ALLOC_COUNT
+long long heap_allocations();
+#endif
+void set_nodelay(int);
+
+void calibration_identity(YazCalibration &);
+bool load_calibration(const std::string &, YazCalibration &);
+bool store_calibration(const std::string &, const YazCalibration &);
 
 #endif // __YAZ_H__
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2005  Joel Sommers.  All rights reserved.
+ *
+ * This file is part of yaz, an end-to-end available bandwidth
+ * measurement tool.
+ *
+ * Yaz is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Yaz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Yaz; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "yaz.h"
+
+#if HAVE_ALLOC_COUNT
+#include <new>
+#include <atomic>
+#include <algorithm>
+
+//
+// heap allocation counter, built only with --enable-alloc-count.  the
+// global operator new is replaced with one that counts calls before
+// handing off to malloc(), so that the sender can show that a
+// measurement round in steady state allocates nothing.  (the pacing
+// thread shares the count, hence the atomic.)  the replacement applies
+// to the whole program, abet included, so it is not on by default.
+//
+
+static std::atomic<long long> yaz_nallocs(0);
+
+long long heap_allocations()
+{
+    return yaz_nallocs.load(std::memory_order_relaxed);
+}
+
+
+static void *counted_alloc(std::size_t n)
+{
+    yaz_nallocs.fetch_add(1, std::memory_order_relaxed);
+    return malloc(n ? n : 1);
+}
+
+
+static void *counted_aligned_alloc(std::size_t n, std::align_val_t al)
+{
+    yaz_nallocs.fetch_add(1, std::memory_order_relaxed);
+    void *p = 0;
+    if (posix_memalign(&p, std::max(sizeof(void *), std::size_t(al)), n ? n : 1) != 0)
+        return 0;
+    return p;
+}
+
+
+void *operator new(std::size_t n)
+{
+    void *p = counted_alloc(n);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](std::size_t n)
+{
+    return operator new(n);
+}
+
+void *operator new(std::size_t n, const std::nothrow_t &) noexcept
+{
+    return counted_alloc(n);
+}
+
+void *operator new[](std::size_t n, const std::nothrow_t &) noexcept
+{
+    return counted_alloc(n);
+}
+
+void *operator new(std::size_t n, std::align_val_t al)
+{
+    void *p = counted_aligned_alloc(n, al);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](std::size_t n, std::align_val_t al)
+{
+    return operator new(n, al);
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, std::size_t) noexcept { free(p); }
+void operator delete[](void *p, std::size_t) noexcept { free(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { free(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { free(p); }
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept { free(p); }
+void operator delete[](void *p, std::size_t, std::align_val_t) noexcept { free(p); }
+
+#endif // HAVE_ALLOC_COUNT
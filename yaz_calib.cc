@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2005  Joel Sommers.  All rights reserved.
+ *
+ * This file is part of yaz, an end-to-end available bandwidth
+ * measurement tool.
+ *
+ * Yaz is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Yaz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Yaz; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "yaz.h"
+
+#include <fstream>
+#include <sstream>
+#include <sys/utsname.h>
+#include <sys/stat.h>
+
+#if HAVE_SYSCTLBYNAME
+#include <sys/sysctl.h>
+#endif
+
+//
+// timing calibration cache.  the os timing measurements taken at
+// startup only depend on the host, so they are saved in a small
+// text file keyed by host name, kernel release, clocksource and cpu
+// model.  on the next start a cached calibration is accepted after
+// a quick sanity check, and a full calibration is redone in the
+// background to keep the file current.  that thread only fills in
+// its own copy; it is joined, and its numbers taken up, before the
+// first stream is paced.
+//
+
+static const int YAZQUICKSAMPLES = 10;
+static const int YAZQUICKSLACK = 1;       // usecs a quick check may be off by
+static const int YAZQUICKFRAC = 4;        // ... or this fraction of the cached value
+
+
+static std::string first_line(const char *path)
+{
+    std::ifstream in(path);
+    std::string line;
+    if (in)
+        std::getline(in, line);
+    return line;
+}
+
+
+static std::string cpu_model()
+{
+    std::string model;
+
+#if HAVE_SYSCTLBYNAME
+    char buf[YAZBUFLEN];
+    size_t buflen = YAZBUFLEN - 1;
+    memset(buf, 0, YAZBUFLEN);
+    if (sysctlbyname("hw.model", buf, &buflen, 0, 0) == 0)
+        model = buf;
+#else
+    std::ifstream in("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.compare(0, 10, "model name") == 0)
+        {
+            size_t colon = line.find(':');
+            if (colon != std::string::npos)
+                model = line.substr(line.find_first_not_of(" \t", colon + 1));
+            break;
+        }
+    }
+#endif
+
+    return model;
+}
+
+
+static time_t boot_time()
+{
+#if HAVE_SYSCTLBYNAME
+    struct timeval tv;
+    size_t tvlen = sizeof(tv);
+    if (sysctlbyname("kern.boottime", &tv, &tvlen, 0, 0) == 0)
+        return tv.tv_sec;
+#else
+    std::ifstream in("/proc/stat");
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.compare(0, 6, "btime ") == 0)
+            return atol(line.c_str() + 6);
+    }
+#endif
+    return 0;
+}
+
+
+// a quick measurement agrees with the cached one if it is within a
+// microsecond or a quarter of it, whichever is larger.  a plain ratio
+// lets a 2us cached value pass against a 5us measurement.
+static bool close_enough(int quick, int cached)
+{
+    int slack = std::max(YAZQUICKSLACK, cached / YAZQUICKFRAC);
+    return (abs(quick - cached) <= slack);
+}
+
+
+void calibration_identity(YazCalibration &cal)
+{
+    char buf[YAZBUFLEN];
+    memset(buf, 0, YAZBUFLEN);
+    gethostname(buf, YAZBUFLEN-1);
+    cal.m_host = buf;
+
+    struct utsname un;
+    if (uname(&un) == 0)
+        cal.m_kernel = std::string(un.sysname) + " " + un.release;
+
+    cal.m_clocksource = first_line("/sys/devices/system/clocksource/clocksource0/current_clocksource");
+    if (cal.m_clocksource == "")
+        cal.m_clocksource = "unknown";
+
+    cal.m_cpu = cpu_model();
+    if (cal.m_cpu == "")
+        cal.m_cpu = "unknown";
+}
+
+
+bool load_calibration(const std::string &path, YazCalibration &cal)
+{
+    std::ifstream in(path.c_str());
+    if (!in)
+        return false;
+
+    int nfields = 0;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line == "" || line[0] == '#')
+            continue;
+
+        size_t sp = line.find(' ');
+        if (sp == std::string::npos)
+            continue;
+        std::string key = line.substr(0, sp);
+        std::string val = line.substr(sp + 1);
+
+        if (key == "host")
+            cal.m_host = val;
+        else if (key == "kernel")
+            cal.m_kernel = val;
+        else if (key == "clocksource")
+            cal.m_clocksource = val;
+        else if (key == "cpu")
+            cal.m_cpu = val;
+        else if (key == "syscall_overhead")
+            cal.m_syscall_overhead = atoi(val.c_str());
+        else if (key == "min_sleep")
+            cal.m_min_sleep = atoi(val.c_str());
+        else if (key == "clock_tick")
+            cal.m_clock_tick = atoi(val.c_str());
+        else
+            continue;
+        nfields++;
+    }
+
+    return (nfields == 7 && cal.m_clock_tick > 0);
+}
+
+
+bool store_calibration(const std::string &path, const YazCalibration &cal)
+{
+    // write to a temporary file and rename so that a concurrent
+    // reader never sees a partially written cache.
+    std::ostringstream tmp;
+    tmp << path << ".tmp." << getpid();
+
+    {
+        std::ofstream out(tmp.str().c_str());
+        if (!out)
+            return false;
+
+        out << "# yaz timing calibration cache" << std::endl;
+        out << "host " << cal.m_host << std::endl;
+        out << "kernel " << cal.m_kernel << std::endl;
+        out << "clocksource " << cal.m_clocksource << std::endl;
+        out << "cpu " << cal.m_cpu << std::endl;
+        out << "syscall_overhead " << cal.m_syscall_overhead << std::endl;
+        out << "min_sleep " << cal.m_min_sleep << std::endl;
+        out << "clock_tick " << cal.m_clock_tick << std::endl;
+        if (!out)
+        {
+            unlink(tmp.str().c_str());
+            return false;
+        }
+    }
+
+    if (rename(tmp.str().c_str(), path.c_str()) < 0)
+    {
+        unlink(tmp.str().c_str());
+        return false;
+    }
+    return true;
+}
+
+
+struct YazCalibRefresh
+{
+    pthread_t m_thread;
+    std::string m_path;
+    YazCalibration m_cal;
+};
+
+
+extern "C"
+{
+    void *calib_refresh_entry(void *arg)
+    {
+        YazCalibRefresh *ycr = static_cast<YazCalibRefresh*>(arg);
+        set_timer_slack(0);
+
+        ycr->m_cal.m_syscall_overhead = int(measure_syscall_overhead(YAZOSTIMINGSAMPLES, 0));
+        ycr->m_cal.m_min_sleep = int(measure_min_sleep(YAZOSTIMINGSAMPLES, 0));
+        if (!store_calibration(ycr->m_path, ycr->m_cal))
+            std::cerr << "!!couldn't refresh calibration cache " << ycr->m_path << std::endl;
+
+        return (0);
+    }
+}
+
+
+void YazEndPt::calibrate()
+{
+    // sleep measurements must be taken with the same timer slack that
+    // the pacing loop runs with.
+    set_timer_slack(m_verbose);
+    getClockTick();
+
+    if (m_calib_file != "")
+    {
+        YazCalibration here;
+        YazCalibration cached;
+        calibration_identity(here);
+
+        if (load_calibration(m_calib_file, cached) &&
+            cached.m_host == here.m_host &&
+            cached.m_kernel == here.m_kernel &&
+            cached.m_clocksource == here.m_clocksource &&
+            cached.m_cpu == here.m_cpu &&
+            cached.m_clock_tick == m_clock_tick)
+        {
+            // a cache written before the last boot may describe another
+            // clocksource setup or microcode, even under the same names.
+            struct stat st;
+            time_t booted = boot_time();
+            bool stale = (stat(m_calib_file.c_str(), &st) < 0 ||
+                          (booted > 0 && st.st_mtime < booted));
+
+            // quick check that the cached numbers are still close.
+            int sco = int(measure_syscall_overhead(YAZQUICKSAMPLES, 0));
+            int msl = int(measure_min_sleep(YAZQUICKSAMPLES, 0));
+
+            if (!stale &&
+                close_enough(sco, cached.m_syscall_overhead) &&
+                close_enough(msl, cached.m_min_sleep))
+            {
+                m_syscall_overhead = cached.m_syscall_overhead;
+                m_min_sleep = cached.m_min_sleep;
+                m_smooth_overhead = m_syscall_overhead;
+                m_smooth_min_sleep = m_min_sleep;
+
+                if (m_verbose)
+                {
+                    std::cout << "##using cached calibration from " << m_calib_file << std::endl;
+                    std::cout << "##cached syscall overhead: " << m_syscall_overhead << " microseconds" << std::endl;
+                    std::cout << "##cached min sleep: " << m_min_sleep << " microseconds" << std::endl;
+                }
+
+                YazCalibRefresh *ycr = new YazCalibRefresh();
+                ycr->m_path = m_calib_file;
+                ycr->m_cal = here;
+                ycr->m_cal.m_clock_tick = m_clock_tick;
+
+                if (pthread_create(&ycr->m_thread, NULL, calib_refresh_entry, ycr) != 0)
+                {
+                    std::cerr << "!! (non-fatal) couldn't start calibration refresh: " << errno << '/' << strerror(errno) << std::endl;
+                    delete ycr;
+                }
+                else
+                    m_refresh = ycr;
+                return;
+            }
+
+            if (m_verbose)
+            {
+                if (stale)
+                    std::cout << "##cached calibration predates boot --- recalibrating" << std::endl;
+                else
+                    std::cout << "##cached calibration failed sanity check (" << sco << '/' << msl << " against " << cached.m_syscall_overhead << '/' << cached.m_min_sleep << ") --- recalibrating" << std::endl;
+            }
+        }
+
+        measureSyscallOverhead();
+        measureMinSleep();
+
+        here.m_syscall_overhead = m_syscall_overhead;
+        here.m_min_sleep = m_min_sleep;
+        here.m_clock_tick = m_clock_tick;
+        if (!store_calibration(m_calib_file, here))
+            std::cerr << "!! (non-fatal) couldn't write calibration cache " << m_calib_file << std::endl;
+        return;
+    }
+
+    measureSyscallOverhead();
+    measureMinSleep();
+}
+
+
+// wait for the background recalibration, if there is one, and take up
+// its numbers.  called from the control thread before anything is
+// paced, so that nothing else is reading them.
+void YazEndPt::finishCalibration()
+{
+    if (!m_refresh)
+        return;
+
+    pthread_join(m_refresh->m_thread, NULL);
+    m_syscall_overhead = m_refresh->m_cal.m_syscall_overhead;
+    m_min_sleep = m_refresh->m_cal.m_min_sleep;
+    m_smooth_overhead = m_syscall_overhead;
+    m_smooth_min_sleep = m_min_sleep;
+
+    if (m_verbose)
+        std::cout << "##refreshed syscall overhead/min sleep: " << m_syscall_overhead << '/' << m_min_sleep << " microseconds" << std::endl;
+
+    delete m_refresh;
+    m_refresh = 0;
+}
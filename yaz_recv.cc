@@ -24,6 +24,10 @@
  */
 
 #include "yaz.h"
+#include <stddef.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <algorithm>
 #if HAVE_PCAP_H
 #include <sstream>
 #endif
@@ -55,7 +59,7 @@ void YazReceiver::prepCtrl()
         throw -1;
     } 
 
-    if (listen(m_ctrl_sd, 2) < 0)
+    if (listen(m_ctrl_sd, YAZLISTENBACKLOG) < 0)
     {
         std::cerr << "!!listen(): " << errno << '/' << strerror(errno) << std::endl;
         throw -1;
@@ -82,22 +86,96 @@ void YazReceiver::prepCtrl()
 
 void YazReceiver::prepProbe()
 {
-    m_probe_sd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (m_probe_sd < 0)
-    {
-        std::cerr << "!!socket(): " << errno << '/' << strerror(errno) << std::endl;
+    // with more than one shard every probe socket binds the same port
+    // with SO_REUSEPORT, and a reuseport program picks the socket from
+    // the session id in the probe.  sockets take their index in the
+    // reuseport group from the order in which they are bound.
+    int ncpus = 1;
+#if HAVE_SYSCONF
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1)
+        ncpus = 1;
+#endif
+
+    // the shards' receive buffers come from the arena, faulted in and
+    // locked before the first probe.
+    if (!m_arena.open(m_nshards * (YAZGROBUFLEN + 64), m_verbose))
         throw -1;
-    } 
 
-    struct sockaddr_in probe_sin;
-    memset(&probe_sin, 0, sizeof(struct sockaddr_in));
-    probe_sin.sin_family = AF_INET;
-    probe_sin.sin_port = htons(DEST_PORT);
-    if (bind(m_probe_sd, (const struct sockaddr*)&probe_sin, sizeof(struct sockaddr_in)) < 0)
+    for (int i = 0; i < m_nshards; ++i)
     {
-        std::cerr << "!!bind(): " << errno << '/' << strerror(errno) << std::endl;
-        throw -1;
-    } 
+        YazShard *sh = new YazShard();
+        sh->m_rbuf = (char *)m_arena.take(YAZGROBUFLEN);
+        sh->m_index = i;
+        sh->m_recv = this;
+        if (m_nshards > 1)
+            sh->m_cpu = i % ncpus;
+        m_shards.push_back(sh);
+
+        sh->m_sd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sh->m_sd < 0)
+        {
+            std::cerr << "!!socket(): " << errno << '/' << strerror(errno) << std::endl;
+            throw -1;
+        } 
+
+#if HAVE_REUSEPORT_CBPF
+        if (m_nshards > 1)
+        {
+            int opt = 1;
+            if (setsockopt(sh->m_sd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+            {
+                std::cerr << "!!setsockopt(SO_REUSEPORT): " << errno << '/' << strerror(errno) << std::endl;
+                throw -1;
+            }
+        }
+#endif
+
+#if HAVE_UDP_GSO
+        // coalesced probes share one arrival time, so only take them
+        // when asked to.  (the default is off, but be explicit.)
+        int gro = m_gro ? 1 : 0;
+        if (setsockopt(sh->m_sd, SOL_UDP, UDP_GRO, &gro, sizeof(gro)) < 0 && m_gro)
+        {
+            std::cerr << "!! (non-fatal) couldn't enable UDP_GRO: " << errno << '/' << strerror(errno) << std::endl;
+            m_gro = false;
+        }
+#endif
+
+        struct sockaddr_in probe_sin;
+        memset(&probe_sin, 0, sizeof(struct sockaddr_in));
+        probe_sin.sin_family = AF_INET;
+        probe_sin.sin_port = htons(DEST_PORT);
+        if (bind(sh->m_sd, (const struct sockaddr*)&probe_sin, sizeof(struct sockaddr_in)) < 0)
+        {
+            std::cerr << "!!bind(): " << errno << '/' << strerror(errno) << std::endl;
+            throw -1;
+        } 
+    }
+    m_probe_sd = m_shards[0]->m_sd;
+
+#if HAVE_REUSEPORT_CBPF
+    if (m_nshards > 1)
+    {
+        // socket index = session id (third word of the udp payload) mod
+        // number of shards.  a runt probe fails the load and goes to
+        // shard 0, which counts it as unknown.
+        struct sock_filter code[] = {
+            BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(YazPkt, m_session)),
+            BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (unsigned int)m_nshards),
+            BPF_STMT(BPF_RET | BPF_A, 0),
+        };
+        struct sock_fprog prog;
+        prog.len = sizeof(code) / sizeof(code[0]);
+        prog.filter = code;
+
+        if (setsockopt(m_probe_sd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+        {
+            std::cerr << "!!setsockopt(SO_ATTACH_REUSEPORT_CBPF): " << errno << '/' << strerror(errno) << std::endl;
+            throw -1;
+        }
+    }
+#endif
 
     if (m_verbose)
     {
@@ -112,68 +190,384 @@ void YazReceiver::prepProbe()
         char buffer[YAZBUFLEN];
         memset(&buffer[0], 0, YAZBUFLEN);
         inet_ntop(AF_INET, &sinname.sin_addr, buffer, YAZBUFLEN-1);
-        std::cout << "##probe sink at " << buffer << " udp/" << DEST_PORT << std::endl;
+        std::cout << "##probe sink at " << buffer << " udp/" << DEST_PORT;
+        if (m_nshards > 1)
+            std::cout << " (" << m_nshards << " shards)";
+        std::cout << std::endl;
     }
+
+#if HAVE_AF_XDP
+    if (m_xdp_dev != "")
+        prepXdp();
+#endif
+#if HAVE_PROBE_TAP
+    if (m_tap_dev != "")
+        prepTap();
+#endif
 }
 
 
+#if HAVE_AF_XDP
+// the udp probe socket stays bound (so that probes that miss the xdp
+// path still land somewhere) but an xdp program on m_xdp_dev moves
+// probes for our port to one AF_XDP socket per rx queue.  on any
+// failure the receiver carries on with the udp socket alone.
+void YazReceiver::prepXdp()
+{
+    int ifindex = if_nametoindex(m_xdp_dev.c_str());
+    if (ifindex == 0)
+    {
+        std::cerr << "!! (non-fatal) no interface " << m_xdp_dev << " - receiving probes through udp socket" << std::endl;
+        m_xdp_dev = "";
+        return;
+    }
+
+    int nqueues = xdp_rx_queues(m_xdp_dev);
+    m_steer = new YazXdpSteer();
+    bool ok = m_steer->attach(ifindex, DEST_PORT, nqueues, m_verbose);
+    for (int q = 0; ok && q < nqueues; ++q)
+    {
+        YazXsk *xsk = new YazXsk();
+        m_xsks.push_back(xsk);
+        ok = xsk->open(ifindex, q, true, false, m_verbose) && m_steer->add(q, xsk->fd());
+    }
+
+    if (!ok)
+    {
+        std::cerr << "!! (non-fatal) AF_XDP probe capture unavailable - receiving probes through udp socket" << std::endl;
+        delete m_steer;
+        m_steer = 0;
+        for (size_t i = 0; i < m_xsks.size(); ++i)
+            delete m_xsks[i];
+        m_xsks.clear();
+        m_xdp_dev = "";
+    }
+}
+#endif
+
+
+#if HAVE_PROBE_TAP
+// the probe tap records probes for our port in the kernel; the udp
+// probe socket stays bound for anything it passes on.  on failure the
+// receiver carries on with the udp socket alone.
+void YazReceiver::prepTap()
+{
+    int ifindex = if_nametoindex(m_tap_dev.c_str());
+    m_tap = new YazProbeTap();
+    if (ifindex == 0 || !m_tap->attach(ifindex, DEST_PORT, m_tap_drop, m_verbose))
+    {
+        std::cerr << "!! (non-fatal) kernel probe tap unavailable on " << m_tap_dev << " - receiving probes through udp socket" << std::endl;
+        delete m_tap;
+        m_tap = 0;
+        m_tap_dev = "";
+    }
+}
+#endif
+
+
 void YazReceiver::cleanup()
 {
-    close (m_probe_sd);
+    stopShards();
+    for (size_t i = 0; i < m_shards.size(); ++i)
+    {
+        close(m_shards[i]->m_sd);
+        delete m_shards[i];
+    }
+    m_shards.clear();
+    m_arena.close();
+    m_probe_sd = -1;
     close (m_ctrl_sd);
 
+#if HAVE_AF_XDP
+    for (size_t i = 0; i < m_xsks.size(); ++i)
+        delete m_xsks[i];
+    m_xsks.clear();
+    delete m_steer;
+    m_steer = 0;
+#endif
+#if HAVE_PROBE_TAP
+    delete m_tap;
+    m_tap = 0;
+#endif
+
 #if HAVE_PCAP_H
     unprepPcap();
 #endif
 }
 
 
-void YazReceiver::getConnection(int &csd, bool &connected)
+extern "C"
 {
-    bool rv = false;
+    void *shard_thread_entry(void *arg)
+    {
+        YazShard *sh = static_cast<YazShard*>(arg);
+        sh->m_recv->shardLoop(sh);
+        return (0);
+    }
+}
 
-    pollfd pfd = {m_ctrl_sd, POLLIN, 0};
-    int n = poll(&pfd, 1, 1000);    // TOCHECK: probably -1 on timeout
 
-    if (n < 0)
+void YazReceiver::startShards()
+{
+    if (m_shards.size() < 2)
+        return;
+
+    for (size_t i = 0; i < m_shards.size(); ++i)
+    {
+        YazShard *sh = m_shards[i];
+        if (pipe(sh->m_wake) < 0)
+        {
+            std::cerr << "!!error creating wakeup pipe for receive shard " << i << ": " << errno << '/' << strerror(errno) << std::endl;
+            cleanup();
+            throw -1;
+        }
+        fcntl(sh->m_wake[0], F_SETFL, O_NONBLOCK);
+        fcntl(sh->m_wake[1], F_SETFL, O_NONBLOCK);
+
+        if (pthread_create(&sh->m_thread, NULL, shard_thread_entry, sh) != 0)
+        {
+            std::cerr << "!!error spawning receive shard " << i << ": " << errno << '/' << strerror(errno) << std::endl;
+            cleanup();
+            throw -1;
+        }
+        sh->m_running = true;
+    }
+}
+
+
+void YazReceiver::stopShards()
+{
+    for (size_t i = 0; i < m_shards.size(); ++i)
+    {
+        YazShard *sh = m_shards[i];
+        if (!sh->m_running)
+            continue;
+        pthread_cancel(sh->m_thread);
+        pthread_join(sh->m_thread, NULL);
+        sh->m_running = false;
+        close(sh->m_wake[0]);
+        close(sh->m_wake[1]);
+        sh->m_wake[0] = sh->m_wake[1] = -1;
+    }
+}
+
+
+void YazReceiver::shardLoop(YazShard *sh)
+{
+#if HAVE_PTHREAD_SETAFFINITY_NP
+    if (sh->m_cpu >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(sh->m_cpu, &cpus);
+        int rv = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+        if (rv != 0)
+            std::cerr << "!! (non-fatal) couldn't pin receive shard " << sh->m_index << " to cpu " << sh->m_cpu << ": " << rv << '/' << strerror(rv) << std::endl;
+        else if (m_verbose)
+            std::cout << "##receive shard " << sh->m_index << " pinned to cpu " << sh->m_cpu << std::endl;
+    }
+#endif
+
+    struct pollfd pfd[2];
+    pfd[0].fd = sh->m_sd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = sh->m_wake[0];
+    pfd[1].events = POLLIN;
+    int poll_timeout = m_high_accuracy ? 0 : -1;
+
+    while (1)
+    {
+        // in busy-poll mode the control thread says when a stream is
+        // expected.  between streams we block outright: setBusy()
+        // writes to the wakeup pipe when a stream is announced.
+        bool busy = false;
+        if (m_busy_poll)
+        {
+            busy = m_busy;
+            poll_timeout = busy ? 0 : -1;
+        }
+
+        pfd[0].revents = pfd[1].revents = 0;
+        int rv = poll(pfd, 2, poll_timeout);
+        if (rv < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "!!error in poll() on receive shard " << sh->m_index << ": " << errno << '/' << strerror(errno) << std::endl;
+            return;
+        }
+        if (pfd[1].revents)
+        {
+            char drain[YAZTINYBUF];
+            while (read(sh->m_wake[0], drain, sizeof(drain)) > 0)
+                ;
+        }
+        if (pfd[0].revents)
+            processProbe(sh);
+        else if (busy)
+            processProbe(sh, MSG_DONTWAIT);     // drives the device queue under SO_BUSY_POLL
+    }
+}
+
+
+void YazReceiver::acceptConnection()
+{
+    struct sockaddr_in csin;
+    SOCKLEN_T sinlen = sizeof(struct sockaddr_in);
+    int sd = accept(m_ctrl_sd, (struct sockaddr *)&csin, &sinlen);
+    if (sd < 0)
     {
-        std::cerr << "error on poll: " << errno << '/' << strerror(errno) << std::endl;
+        // the peer may already have given up; not our problem.
+        if (errno == ECONNABORTED || errno == EAGAIN || errno == EINTR)
+            return;
+        std::cerr << "error on accept: " << errno << '/' << strerror(errno) << std::endl;
         cleanup();
         throw -1;
     }
-    else if (n == 1 && (pfd.revents & POLLIN))
+
+    set_nodelay(sd);
+    finishCalibration();
+
+    // all the sessions share this thread: a peer that stops half way
+    // through a message must not hold up the others.
+    int flags = fcntl(sd, F_GETFL, 0);
+    if (flags < 0 || fcntl(sd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        std::cerr << "!!couldn't make control connection non-blocking: " << errno << '/' << strerror(errno) << std::endl;
+        close(sd);
+        return;
+    }
+
+    // its stream slabs are written from the probe path; fault them in
+    // here instead.
+    YazSession *sess = new YazSession();
+    YazArena::prefault(sess, sizeof(*sess));
+    sess->m_ctrl_sd = sd;
+    m_conns[sd] = sess;
+    m_poller.add(sd);
+
+    if (m_verbose)
+    {
+        char buffer[YAZTINYBUF];
+        memset(buffer, 0, YAZTINYBUF);
+        inet_ntop(AF_INET, &csin.sin_addr, buffer, YAZTINYBUF-1);
+        std::cout << "!! got connection from " << buffer << " (" << m_conns.size() << " sessions)" << std::endl;
+    }
+}
+
+
+void YazReceiver::closeSession(YazSession *sess)
+{
+    if (m_verbose)
+        std::cout << "!! session " << sess->m_id << " closed (dropped: late " << sess->m_late << " dup " << sess->m_dups << " overflow " << sess->m_overflow << " evicted streams " << sess->m_evicted << ")" << std::endl;
+
+    m_poller.remove(sess->m_ctrl_sd);
+    close(sess->m_ctrl_sd);
+    m_conns.erase(sess->m_ctrl_sd);
+    expectStream(sess, 0);
+
+    if (sess->m_id)
+    {
+        YazShard *sh = shardFor(sess->m_id);
+        pthread_mutex_lock(&sh->m_mutex);
+        std::map<unsigned int, YazSession*>::iterator it = sh->m_sessions.find(sess->m_id);
+        if (it != sh->m_sessions.end() && it->second == sess)
+            sh->m_sessions.erase(it);
+        pthread_mutex_unlock(&sh->m_mutex);
+    }
+    delete sess;
+}
+
+
+// note when a session's next stream should be over (nsecs), or that it
+// isn't expecting one (0).  the receiver busy-polls while any session
+// is expecting a stream.
+void YazReceiver::expectStream(YazSession *sess, long long until)
+{
+    sess->m_busy_until = until;
+    m_busy_until = until;
+    for (std::map<int, YazSession*>::iterator it = m_conns.begin(); it != m_conns.end(); ++it)
+        m_busy_until = std::max(m_busy_until, it->second->m_busy_until);
+}
+
+
+// whether we should be busy-polling now, switching the probe sockets
+// over if that has changed.
+bool YazReceiver::busyPolling()
+{
+    bool busy = (m_busy_until != 0);
+    if (busy && now_nsecs() >= m_busy_until)
+    {
+        // no RST in time - the sender has gone quiet.
+        m_busy_until = 0;
+        busy = false;
+    }
+    if (busy != m_busy)
+        setBusy(busy);
+    return busy;
+}
+
+
+void YazReceiver::setBusy(bool busy)
+{
+    if (m_verbose > 2)
+        std::cout << (busy ? "##stream expected - busy-polling" : "##no stream expected - blocking") << std::endl;
+
+#if HAVE_SO_BUSY_POLL
+    // SO_PREFER_BUSY_POLL leaves the device queue to us rather than to
+    // softirq (given napi_defer_hard_irqs on the device).  raising the
+    // budget or preferring busy polling needs CAP_NET_ADMIN.
+    static bool warned = false;
+    int usecs = busy ? m_busy_poll : 0;
+    int prefer = busy ? 1 : 0;
+    int budget = YAZBUSYBUDGET;
+    std::vector<int> fds;
+    for (size_t i = 0; i < m_shards.size(); ++i)
+        fds.push_back(m_shards[i]->m_sd);
+#if HAVE_AF_XDP
+    for (size_t i = 0; i < m_xsks.size(); ++i)
+        fds.push_back(m_xsks[i]->fd());
+#endif
+    for (size_t i = 0; i < fds.size(); ++i)
     {
-        struct sockaddr_in csin;
-        SOCKLEN_T sinlen = sizeof(struct sockaddr_in);
-        int sd = accept(m_ctrl_sd, (struct sockaddr *)&csin, &sinlen);
-        if (sd <= 0)
+        bool ok = (setsockopt(fds[i], SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == 0);
+        ok = (setsockopt(fds[i], SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) == 0) && ok;
+        if (busy)
+            ok = (setsockopt(fds[i], SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget)) == 0) && ok;
+        if (!ok && busy && !warned)
         {
-            std::cerr << "error on accept: " << errno << '/' << strerror(errno) << std::endl;
-            cleanup();
-            throw -1;
-        } 
-        else
+            std::cerr << "!! (non-fatal) couldn't set up busy polling: " << errno << '/' << strerror(errno) << " - spinning without it" << std::endl;
+            warned = true;
+        }
+    }
+#endif
+
+    m_busy = busy;
+
+    // a worker blocked between streams only looks at m_busy again
+    // once something wakes it.
+    if (busy)
+    {
+        for (size_t i = 0; i < m_shards.size(); ++i)
         {
-            rv = true;
-            csd = sd;
-            connected = true;
-        } 
+            char c = 0;
+            if (m_shards[i]->m_wake[1] >= 0 && write(m_shards[i]->m_wake[1], &c, 1) < 0 && errno != EAGAIN)
+                std::cerr << "!! (non-fatal) couldn't wake receive shard " << i << ": " << errno << '/' << strerror(errno) << std::endl;
+        }
     }
 }
 
 
 void YazReceiver::run()
 {
-    bool connected = false;
-    int csd = 0;
-
 #if HAVE_PCAP_H
     std::ostringstream ostr;
     ostr << "udp and dst port " << m_probe_dest;
     m_pcap_filter_string = ostr.str();
 #endif
 
-    int poll_timeout = m_high_accuracy ? 0 : -1;
+    int poll_timeout = -1;
+    bool plain_probes = false;      // probes read from the socket on this thread
     try
     {
         prepCtrl();
@@ -182,52 +576,129 @@ void YazReceiver::run()
         prepPcap();
 #endif
 
-        while (1)
+        m_poller.init(m_uring, m_verbose);
+        m_poller.add(m_ctrl_sd);
+        if (m_shards.size() == 1)
         {
-            csd = 0;
-            connected = false;
-            while (!connected)
+            // unsharded: probes are read on this thread.  with the probe
+            // tap they are read from its ring buffer instead, and any
+            // that the tap passes on are left in the socket unread.
+            bool probes_polled = false;
+#if HAVE_PROBE_TAP
+            if (m_tap)
             {
-                getConnection(csd, connected); 
-                if (connected && m_verbose)
-                    std::cout << "!! got connection" << std::endl;
+                m_poller.add(m_tap->fd());
+                probes_polled = true;
             }
+#endif
+#if HAVE_IO_URING
+            if (!probes_polled && m_poller.uring())
+            {
+                // kernel receive stamps, since a completion may be
+                // reaped well after its datagram arrived.
+                int on = 1;
+                setsockopt(m_probe_sd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+                int paylen = m_gro ? YAZGROBUFLEN : YAZURINGBUFLEN;
+                probes_polled = m_poller.addRecv(m_probe_sd, paylen, m_gro ? YAZURINGBUFS / 8 : YAZURINGBUFS);
+                if (!probes_polled)
+                    std::cerr << "!! (non-fatal) no multishot receive on this kernel - polling the probe socket" << std::endl;
+            }
+#endif
+            if (!probes_polled)
+            {
+                m_poller.add(m_probe_sd);
+                plain_probes = true;
+            }
+#if HAVE_AF_XDP
+            for (size_t i = 0; i < m_xsks.size(); ++i)
+                m_poller.add(m_xsks[i]->fd());
+#endif
+            if (m_high_accuracy)
+                poll_timeout = 0;
+        }
+        else
+            startShards();
 
-            pollfd pfd[2];
-            int npfd = 0;
-            memset(pfd, 0, sizeof(pollfd) * 2);
-            while (connected)
+        while (1)
+        {
+            // in busy-poll mode spin only while a stream is expected:
+            // from its notice to its RST, or to its expected end.  the
+            // shard workers spin themselves, so then we just wait to
+            // see the stream out.
+            int timeout = poll_timeout;
+            bool busy = false;
+            if (m_busy_poll)
             {
-                pfd[0].fd = csd;
-                pfd[0].events = POLLIN;
-                pfd[0].revents = 0;
+                busy = busyPolling();
+                timeout = -1;
+                if (busy && m_shards.size() == 1)
+                    timeout = 0;
+                else if (busy)
+                    timeout = int((m_busy_until - now_nsecs()) / 1000000LL) + 1;
+            }
 
-                pfd[1].fd = m_probe_sd;
-                pfd[1].events = POLLIN;
-                pfd[1].revents = 0;
+            int rv = m_poller.wait(m_ready, timeout);
+            if (rv == -1)
+            {
+                std::cerr << "error in poll(): " << errno << '/' << strerror(errno) << std::endl;
+                cleanup();
+                throw -1;
+            }
+            if (rv == 0 && busy && plain_probes)
+            {
+                // the receive itself is what polls the device under
+                // SO_BUSY_POLL; readiness only shows what has already
+                // been processed.
+                processProbe(m_shards[0], MSG_DONTWAIT);
+                continue;
+            }
 
-                npfd = 2;
-                int rv = poll(&pfd[0], npfd, poll_timeout);
-                if (rv == -1)
+            // probes first: their stamps are the time-critical part, and
+            // a RST must not be answered while probes are still queued.
+            bool probe_ready = false;
+            for (size_t i = 0; i < m_ready.size() && !probe_ready; ++i)
+                probe_ready = (m_ready[i] == m_probe_sd);
+            if (probe_ready)
+            {
+#if HAVE_IO_URING
+                if (m_poller.receiving())
+                    processRing(m_shards[0]);
+                else
+#endif
+                processProbe(m_shards[0]);
+            }
+#if HAVE_AF_XDP
+            for (size_t i = 0; i < m_xsks.size(); ++i)
+            {
+                if (std::find(m_ready.begin(), m_ready.end(), m_xsks[i]->fd()) != m_ready.end())
                 {
-                    std::cerr << "error in poll(): " << errno << '/' << strerror(errno) << std::endl;
-                    cleanup();
-                    throw -1;
+                    processXsk(m_shards[0], m_xsks[i]);
+                    probe_ready = true;
                 }
+            }
+#endif
+#if HAVE_PROBE_TAP
+            if (m_tap && std::find(m_ready.begin(), m_ready.end(), m_tap->fd()) != m_ready.end())
+            {
+                processTap(m_shards[0]);
+                probe_ready = true;
+            }
+#endif
+            if (probe_ready)
+                continue;
 
-                if (rv > 0)
+            for (size_t i = 0; i < m_ready.size(); ++i)
+            {
+                int fd = m_ready[i];
+                if (fd == m_ctrl_sd)
+                    acceptConnection();
+                else
                 {
-                    if (pfd[1].revents & POLLIN)
-                    {
-                        processProbe();
-                    }
-                    else if (pfd[0].revents & POLLIN)
-                    {
-                        processControlMessage(csd, connected);
-                    }
-
+                    std::map<int, YazSession*>::iterator it = m_conns.find(fd);
+                    if (it != m_conns.end())
+                        processControlMessage(it->second);
                 }
-            } 
+            }
         }
     }
     catch (...)
@@ -235,6 +706,8 @@ void YazReceiver::run()
         std::cout << "!!fatal error - receiver stopping" << std::endl;
     }
 
+    stopShards();
+
 #if HAVE_PCAP_H
     *m_running = false;
     if (m_using_pcap && *m_pcap_thread)
@@ -244,65 +717,207 @@ void YazReceiver::run()
 }
 
 
-void show_app_probes(const std::vector<ProbeStamp>& app_probes){
+void show_app_probes(const YazStamps& app_probes){
     std::cout << "!!App probes:" << std::endl;
-    for (const auto& ps: app_probes){
-        std::cout << ps.m_sequence << " ";
+    for (int i = 0; i < app_probes.size(); ++i){
+        std::cout << app_probes.m_seq[i] << " ";
     }
     std::cout << std::endl;
     return;
 }
 
 
-void YazReceiver::processControlMessage(int sd, bool &connected)
+// beyond the summary, send only what the sender asked for: a bitmap
+// of the sequence numbers that arrived, or all the stamps.  the report
+// is built into m_reply_extra, which keeps its capacity between
+// replies.
+void YazReceiver::buildReport(YazCtrlMsg &pmsg)
 {
-    YazCtrlMsg pmsg;
-    char *buffer = 0;
-    YazRstResponse *yrr = 0;
+    m_reply_extra.clear();
+    switch (ntohl(pmsg.m_report))
+    {
+    case PREPORT_STAMPS:
+        m_psvec.encode(m_drained, m_reply_extra);
+        break;
+    case PREPORT_LOSSMAP:
+    case PREPORT_DELAYS:
+        {
+            int nbits = 0;
+            for (int i = 0; i < YAZSLABCAP; ++i)
+                if (m_drained_seen.test(i))
+                    nbits = i + 1;
+
+            // delays: a word giving the bitmap length in bits, the
+            // bitmap, then one delay per probe that arrived, in
+            // sequence order.
+            size_t mapoff = 0;
+            if (ntohl(pmsg.m_report) == PREPORT_DELAYS)
+            {
+                unsigned int nb = htonl(nbits);
+                m_reply_extra.append((const char *)&nb, sizeof(nb));
+                mapoff = sizeof(nb);
+            }
+            m_reply_extra.append((nbits + 7) / 8, '\0');
+            for (int i = 0; i < nbits; ++i)
+                if (m_drained_seen.test(i))
+                    m_reply_extra[mapoff + i / 8] |= char(1 << (i % 8));
+
+            if (ntohl(pmsg.m_report) == PREPORT_DELAYS)
+            {
+                for (int i = 0; i < nbits; ++i)
+                {
+                    if (!m_drained_seen.test(i))
+                        continue;
+                    int d = htonl(m_drained_delays[i]);
+                    m_reply_extra.append((const char *)&d, sizeof(d));
+                }
+            }
+        }
+        break;
+    default:
+        pmsg.m_report = htonl(PREPORT_SUMMARY);
+        break;
+    }
+}
 
-    std::string sps_vec_str = serialize_psvec(m_app_probes).SerializeAsString();  // serialized
-    int remain = sizeof(YazCtrlMsg);
-    int offset = 0;
+
+void YazReceiver::processControlMessage(YazSession *sess)
+{
+    int sd = sess->m_ctrl_sd;
     bool valid_measurement = false;
-    while (remain > 0)
+
+    // take what has arrived of the message; the rest comes with a
+    // later readiness event.
+    int offset = sess->m_ctrl_have;
+    int n = recv(sd, ((char*)&sess->m_ctrl_msg)+offset, sizeof(YazCtrlMsg) - offset, 0);
+    if (n < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return;
+        std::cerr << "!!error on recv() for control message: " << errno << '/' << strerror(errno) << std::endl;
+        closeSession(sess);
+        return;
+    }
+
+    if (n == 0)
+    {
+        closeSession(sess);
+        return;
+    }
+
+    offset += n;
+    if (offset < int(sizeof(YazCtrlMsg)))
     {
-        int n = recv(sd, ((char*)&pmsg)+offset, remain, 0);
-        if (n < 0)
+        sess->m_ctrl_have = offset;
+        return;
+    }
+    sess->m_ctrl_have = 0;
+    YazCtrlMsg pmsg = sess->m_ctrl_msg;
+
+    sess->m_ctrl_seq = ntohl(pmsg.m_seq);
+
+    // no request carries a body; one that says it does is out of step
+    // with us.
+    if (ntohl(pmsg.m_len) != 0)
+    {
+        std::cerr << "!!control message with unexpected " << ntohl(pmsg.m_len) << " byte body - dropping connection" << std::endl;
+        closeSession(sess);
+        return;
+    }
+
+    // the first message on a connection binds it to the sender's
+    // session id.  refuse an id that another connection already has.
+    unsigned int id = ntohl(pmsg.m_session);
+    if (sess->m_id == 0 && id != 0)
+    {
+        YazShard *sh = shardFor(id);
+        pthread_mutex_lock(&sh->m_mutex);
+        bool dup = (sh->m_sessions.find(id) != sh->m_sessions.end());
+        if (!dup)
+            sh->m_sessions[id] = sess;
+        pthread_mutex_unlock(&sh->m_mutex);
+
+        if (dup)
         {
-            std::cerr << "!!error on recv() for control message: " << errno << '/' << strerror(errno) << std::endl;
-            throw -1;
+            std::cerr << "!!duplicate session id " << id << " - dropping connection" << std::endl;
+            closeSession(sess);
+            return;
         }
+        sess->m_id = id;
+        if (m_verbose)
+            std::cout << "!! session " << id << " started" << std::endl;
+    }
+    else if (id != sess->m_id)
+    {
+        if (m_verbose)
+            std::cout << "##session id changed on control connection - ignoring message" << std::endl;
+        pmsg.m_code = htonl(PCTRL_INVALID);
+    }
+
+    // a stream notice gets no reply.  busy-poll for the stream until
+    // its RST, allowing it twice its expected length.
+    if (sess->m_id && ntohl(pmsg.m_code) == PCTRL_STREAM)
+    {
+        long long expect = ntohl(pmsg.m_reason) * 1000LL;
+        expectStream(sess, now_nsecs() + 2 * expect + YAZBUSYGRACE * 1000000LL);
+        if (m_verbose > 2)
+            std::cout << "##session " << sess->m_id << " stream " << ntohl(pmsg.m_stream) << " expected, " << ntohl(pmsg.m_reason) << " usecs" << std::endl;
+        return;
+    }
 
-        if (n == 0)
+    // a RST takes the stamps and spacing summary of the stream it
+    // names.  the stamp buffers are swapped rather than copied so both
+    // keep their capacity.
+    m_drained.clear();
+    m_drained_stats.reset();
+    m_drained_seen.reset();
+    if (sess->m_id && ntohl(pmsg.m_code) == PCTRL_RST)
+    {
+        expectStream(sess, 0);
+        YazShard *sh = shardFor(sess->m_id);
+        if (sh->m_running)
         {
-            close(sd);
-            connected = false;
-            return;
+            // the shard's worker may still have the tail of the
+            // stream queued.
+            int queued = 0;
+            for (int waited = 0; waited < YAZSHARDDRAIN; ++waited)
+            {
+                if (ioctl(sh->m_sd, FIONREAD, &queued) < 0 || queued == 0)
+                    break;
+                poll(0, 0, 1);
+            }
+        }
+        pthread_mutex_lock(&sh->m_mutex);
+        sess->drainStream(ntohl(pmsg.m_stream), m_drained, m_drained_stats, m_drained_seen, m_drained_delays);
+        pthread_mutex_unlock(&sh->m_mutex);
+
+        if (m_verbose > 1)
+        {
+            std::cout << "##session " << sess->m_id << " stream " << ntohl(pmsg.m_stream) << ": " << m_drained.size() << " stamps, late " << sess->m_late << " dup " << sess->m_dups << " overflow " << sess->m_overflow << " evicted " << sess->m_evicted << " (shard gro batches " << sh->m_gro_batches << " warmups " << sh->m_warmups << ")" << std::endl;
+            std::cout << "##spc nspacings: " << m_drained_stats.m_count << " nlost: " << m_drained_stats.m_lost << " reordered: " << m_drained_stats.m_reorder << " mean: " << m_drained_stats.mean() << " sd: " << m_drained_stats.stddev() << " min: " << m_drained_stats.m_min << " max: " << m_drained_stats.m_max << std::endl;
+            std::cout << "##owd mean: " << m_drained_stats.owdMean() << " min: " << m_drained_stats.m_owd_min << " max: " << m_drained_stats.m_owd_max << " nsecs; spacing error mean: " << m_drained_stats.errMean() << " nsecs" << std::endl;
         }
-   
-        
-        remain -= n;
-        offset += n;
     }
-    
-    m_ctrl_seq = ntohl(pmsg.m_seq);
-    assert (ntohl(pmsg.m_len) == 0);
 
     if (m_verbose > 3)
         std::cout << "## received " << offset << " byte control message" << std::endl;
 
+    // the reply goes out in one sendmsg(): header, then for a good
+    // measurement the summary and whatever report the sender asked for.
+    struct iovec iov[3];
+    iov[0].iov_base = &pmsg;
+    iov[0].iov_len = sizeof(YazCtrlMsg);
+    int iovcnt = 1;
+
     switch (ntohl(pmsg.m_code))
     {
     case PCTRL_RST:
         {
             if (m_verbose > 1)
                 std::cout << "## received RST control message" << std::endl;
-            assert (pmsg.m_len == 0);
-            yrr = new YazRstResponse();
-            buffer = (char *)yrr;
+            YazRstResponse *yrr = &m_reply_rst;
+            *yrr = YazRstResponse();
 
-            pmsg.m_len = htonl(sizeof(YazRstResponse));
-            pmsg.m_ps_vec_len = htonl(sps_vec_str.length());    // mb troubles with null-terminator
             pmsg.m_code = htonl(PCTRL_RST_ACK);
             pmsg.m_reason = 0;  // FIXME
 
@@ -310,9 +925,12 @@ void YazReceiver::processControlMessage(int sd, bool &connected)
             int nsamp = 0;
             int nlost = 0;
 
-            valid_measurement = getSpacing(&m_app_probes, mean, nsamp, nlost);
+            valid_measurement = m_drained_stats.valid();
+            mean = m_drained_stats.mean();
+            nsamp = m_drained_stats.m_count;
+            nlost = m_drained_stats.m_lost;
             //if (nlost != 0){
-            //    show_app_probes(m_app_probes);
+            //    show_app_probes(m_drained);
             //}
             yrr->m_app_mean = htonl((unsigned int)(mean));
             yrr->m_nsamples = htonl(nsamp);
@@ -321,36 +939,51 @@ void YazReceiver::processControlMessage(int sd, bool &connected)
             unsigned int ttl = 0;
 
 #if HAVE_PCAP_H
-            size_t napp_probes = m_app_probes.size();
+            size_t napp_probes = m_drained.size();
 #endif
 
 #if HAVE_PCAP_H
             if (m_using_pcap)
             {
+                // the pcap thread sees every session's probes; pull out
+                // the ones that belong to this session.
                 int maxwait = pcap_wait_timeout;
 
-                while (napp_probes > m_pcap_probes->size() && maxwait > 0)
+                while (napp_probes > countPcapProbes(sess->m_id) && maxwait > 0)
                 {
                     poll(0, 0, 10);
                     maxwait -= 10;
                 }
 
-                if (napp_probes > m_pcap_probes->size())
+                YazStampVec pcap_probes;
+                pthread_mutex_lock(m_pcap_mutex);
+                YazStampVec::iterator keep = m_pcap_probes->begin();
+                for (YazStampVec::iterator it = m_pcap_probes->begin(); it != m_pcap_probes->end(); ++it)
+                {
+                    if (it->m_session == sess->m_id)
+                    {
+                        // anything else of this session's is late.
+                        if (it->m_stream == ntohl(pmsg.m_stream))
+                            pcap_probes.push_back(*it);
+                    }
+                    else
+                        *keep++ = *it;
+                }
+                m_pcap_probes->erase(keep, m_pcap_probes->end());
+                pthread_mutex_unlock(m_pcap_mutex);
+
+                if (napp_probes > pcap_probes.size())
                 {
                     std::cout << "##warning: didn't get all probes at pcap level" << std::endl;
-                    std::cout << "##app probes<" << napp_probes << ">pcap probes<" << m_pcap_probes->size() << ">" << std::endl;
+                    std::cout << "##app probes<" << napp_probes << ">pcap probes<" << pcap_probes.size() << ">" << std::endl;
                 }
 
-                pthread_mutex_lock(m_pcap_mutex);
                 valid_measurement = valid_measurement && 
-                                    getSpacing(m_pcap_probes, mean, nsamp, nlost);
+                                    getSpacing(&pcap_probes, mean, nsamp, nlost);
 
       
                 valid_measurement = valid_measurement && 
-                                    checkTTL(m_pcap_probes, ttl);
-           
-                m_pcap_probes->clear();
-                pthread_mutex_unlock(m_pcap_mutex);
+                                    checkTTL(&pcap_probes, ttl);
             }
 #endif // HAVE_PCAP_H
 
@@ -366,11 +999,17 @@ void YazReceiver::processControlMessage(int sd, bool &connected)
                 pmsg.m_code = htonl(PCTRL_RST_NACK);
                 pmsg.m_len = 0;
                 pmsg.m_ps_vec_len = 0;
-
-                delete (yrr);
-                yrr = 0;
-                buffer = 0;
+                break;
             }
+
+            buildReport(pmsg);
+            pmsg.m_len = htonl(sizeof(YazRstResponse));
+            pmsg.m_ps_vec_len = htonl(m_reply_extra.length());
+            iov[1].iov_base = yrr;
+            iov[1].iov_len = sizeof(YazRstResponse);
+            iov[2].iov_base = &m_reply_extra[0];
+            iov[2].iov_len = m_reply_extra.length();
+            iovcnt = 3;
         }
         break;
 
@@ -382,97 +1021,390 @@ void YazReceiver::processControlMessage(int sd, bool &connected)
         break;
     }
 
+    if (!send_iov(sd, iov, iovcnt))
+    {
+        std::cerr << "!!error on send() of control message: " << errno << '/' << strerror(errno) << std::endl;
+        closeSession(sess);
+        return;
+    }
+    m_drained.clear();   // mb also clear protobuf things
+
+    sess->m_ctrl_seq++;
 
-    // send pmsg, and if m_len > 0, buffer
-    remain = sizeof(YazCtrlMsg);
-    offset = 0;
-    while (remain)
+    // between streams: refresh the stamp correction.
+    if (m_recal_interval > 0 && ++m_streams_since_recal >= m_recal_interval)
     {
-        int n = send(sd, ((char *)&pmsg)+offset, remain, 0);
-        if (n <= 0)
-        {
-            std::cerr << "!!error on send() of control message: " << errno << '/' << strerror(errno) << std::endl;
-            throw -1;
-        }
+        recalibrate(false);
+        m_streams_since_recal = 0;
+    }
+}
+
+
+void YazReceiver::processProbe(YazShard *sh, int flags)
+{
+    struct iovec iov;
+    iov.iov_base = sh->m_rbuf;
+    iov.iov_len = YAZGROBUFLEN;
+
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t rbytes = recvmsg(sh->m_sd, &msg, flags);
+    if (rbytes < 0)
+    {
+        if ((flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        std::cout << "!!recvfrom() (probe receive): " << errno << '/' << strerror(errno) << ")" << std::endl;
+        return;
+    }
 
-        remain -= n;
-        offset += n;
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+
+    // subtract overhead from recvfrom() and gettimeofday()
+    tv.tv_usec -= m_syscall_overhead * 2;
+    while (tv.tv_usec < 0)
+    {
+        tv.tv_sec -= 1;
+        tv.tv_usec += 1000000;
     }
 
-    if (valid_measurement){
-        remain = ntohl(pmsg.m_len);
-        offset = 0;
-        while (remain)
+    // with UDP_GRO on, one receive may hold a run of probes, all with
+    // the arrival time of the last.  the mean spacing of a stream is
+    // unaffected (the gaps still add up to the same span); only the
+    // individual gaps are lost.
+    ssize_t segsize = rbytes;
+#if HAVE_UDP_GSO
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+    {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
         {
-            int n = send(sd, buffer+offset, remain, 0);
-            if (n <= 0)
+            int gso_size = 0;
+            memcpy(&gso_size, CMSG_DATA(cm), sizeof(int));
+            if (gso_size > 0 && gso_size < rbytes)
             {
-                std::cerr << "!!error on send() of control payload: " << errno << '/' << strerror(errno) << std::endl;
-                throw -1;
+                segsize = gso_size;
+                sh->m_gro_batches++;
             }
-
-            remain -= n;
-            offset += n;
         }
+    }
+#endif
+
+    for (ssize_t off = 0; off < rbytes; off += segsize)
+        fileProbe(sh, sh->m_rbuf + off, std::min(segsize, rbytes - off), tv);
+}
 
-        // send m_app_probes;
-        remain = sps_vec_str.length();
-        offset = 0;
-        while (remain)
+
+#if HAVE_IO_URING
+// datagrams from the multishot receive.  they carry a kernel stamp
+// (SO_TIMESTAMPNS) in place of the gettimeofday() after recvmsg().
+void YazReceiver::processRing(YazShard *sh)
+{
+    const std::vector<YazRingMsg> &msgs = m_poller.received();
+    for (size_t i = 0; i < msgs.size(); ++i)
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = msgs[i].m_control;
+        msg.msg_controllen = msgs[i].m_control_len;
+
+        struct timeval tv;
+        bool stamped = false;
+        ssize_t rbytes = msgs[i].m_len;
+        ssize_t segsize = rbytes;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
         {
-            int n = send(sd, sps_vec_str.c_str()+offset, remain, 0);
-            if (n <= 0)
+            if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS)
             {
-                std::cerr << "!!error on send() of m_app_probes: " << errno << '/' << strerror(errno) << std::endl;
-                throw -1;
+                struct timespec ts;
+                memcpy(&ts, CMSG_DATA(cm), sizeof(struct timespec));
+                tv.tv_sec = ts.tv_sec;
+                tv.tv_usec = ts.tv_nsec / 1000;
+                stamped = true;
             }
-
-            remain -= n;
-            offset += n;
+#if HAVE_UDP_GSO
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+            {
+                int gso_size = 0;
+                memcpy(&gso_size, CMSG_DATA(cm), sizeof(int));
+                if (gso_size > 0 && gso_size < rbytes)
+                {
+                    segsize = gso_size;
+                    sh->m_gro_batches++;
+                }
+            }
+#endif
         }
+        if (!stamped)
+            gettimeofday(&tv, 0);
+
+        for (ssize_t off = 0; off < rbytes; off += segsize)
+            fileProbe(sh, msgs[i].m_payload + off, std::min(segsize, rbytes - off), tv);
     }
-    if (buffer)
-        delete [] buffer;
-    m_app_probes.clear();   // mb also clear protobuf things
+    m_poller.releaseReceived();
+}
+#endif
 
-    m_ctrl_seq++;
+
+#if HAVE_AF_XDP
+void YazReceiver::processXsk(YazShard *sh, YazXsk *xsk)
+{
+    struct xdp_desc descs[YAZMAXEVENTS];
+    int n = xsk->rxPeek(descs, YAZMAXEVENTS);
+    if (n == 0)
+        return;
+
+    long long now = now_nsecs();
+    long long wallclock = wallclock_offset();
+    for (int i = 0; i < n; ++i)
+    {
+        // the program only passes ipv4 without options, so the probe
+        // starts at a fixed offset.
+        const char *frame = xsk->frame(descs[i].addr);
+        int hdrs = ETH_HLEN + sizeof(struct ip) + sizeof(struct udphdr);
+        long long stamp = xsk->rxStamp(descs[i]);
+        if (stamp == 0)
+            stamp = now;
+
+        struct timeval tv;
+        nsecs_to_timeval(stamp + wallclock, tv);
+        const struct ip *iph = (const struct ip *)(frame + ETH_HLEN);
+        fileProbe(sh, frame + hdrs, int(descs[i].len) - hdrs, tv, iph->ip_ttl);
+    }
+    xsk->rxRelease(descs, n);
 }
+#endif
 
 
-void YazReceiver::processProbe()
+#if HAVE_PROBE_TAP
+void YazReceiver::processTap(YazShard *sh)
 {
-    char buffer[YAZBUFLEN];
+    YazTapRecord recs[YAZMAXEVENTS];
+    long long wallclock = wallclock_offset();
+    int n;
+    while ((n = m_tap->read(recs, YAZMAXEVENTS)) > 0)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            struct timeval tv;
+            nsecs_to_timeval(recs[i].m_ktime + wallclock, tv);
+            fileProbe(sh, (const char *)&recs[i].m_pkt, sizeof(YazPkt), tv, recs[i].m_ttl);
+        }
+    }
+}
+#endif
 
-    ssize_t rbytes = recv(m_probe_sd, buffer, YAZBUFLEN, 0);
-    if (rbytes < 0)
+
+void YazReceiver::fileProbe(YazShard *sh, const char *buffer, ssize_t rbytes,
+                            const struct timeval &tv, unsigned int ttl)
+{
+    if (rbytes < (ssize_t)sizeof(YazPkt))
     {
-        std::cout << "!!recvfrom() (probe receive): " << errno << '/' << strerror(errno) << ")" << std::endl;
+        sh->m_unknown_probes++;
         return;
     }
 
-    struct timeval tv;
-    gettimeofday(&tv, 0);
-
     ProbeStamp ps;
-    YazPkt *pp = (YazPkt*)buffer;
+    const YazPkt *pp = (const YazPkt*)buffer;
+    ps.m_session = ntohl(pp->m_session);
     ps.m_stream = ntohl(pp->m_stream);
     ps.m_sequence = ntohl(pp->m_sequence);
     ps.m_ts = tv;
+    ps.m_ttl = ttl;
+    long long sent = ((long long)ntohl(pp->m_sent_hi) << 32) | ntohl(pp->m_sent_lo);
+    int spacing = ntohl(pp->m_spacing);
 
-    // subtract overhead from recvfrom() and gettimeofday()
-    ps.m_ts.tv_usec -= m_syscall_overhead * 2;
-    while (ps.m_ts.tv_usec < 0)
+    if (ps.m_sequence == YAZWARMUPSEQ)
+    {
+        sh->m_warmups++;
+        return;
+    }
+
+    pthread_mutex_lock(&sh->m_mutex);
+    std::map<unsigned int, YazSession*>::iterator it = sh->m_sessions.find(ps.m_session);
+    bool known = (it != sh->m_sessions.end());
+    bool filed = known && it->second->fileStamp(ps, sent, now_nsecs(), 1000000.0 / m_clock_tick, spacing);
+    pthread_mutex_unlock(&sh->m_mutex);
+
+    if (!known)
+    {
+        if (m_verbose > 1)
+            std::cout << "##probe for unknown session " << ps.m_session << std::endl;
+        sh->m_unknown_probes++;
+        return;
+    }
+
+    if (!filed)
     {
-        ps.m_ts.tv_sec -= 1;
-        ps.m_ts.tv_usec += 1000000;
+        if (m_verbose > 1)
+            std::cout << "##dropped probe " << ps.m_session << ' ' << ps.m_stream << ' ' << ps.m_sequence << std::endl;
+        return;
     }
 
     if (m_verbose > 1)
     {
-        std::cout << ps.m_ts.tv_sec << '.' << std::setw(6) << std::setfill('0') << ps.m_ts.tv_usec << ' ' << ps.m_stream << ' ' << ps.m_sequence << std::endl;
+        std::cout << ps.m_ts.tv_sec << '.' << std::setw(6) << std::setfill('0') << ps.m_ts.tv_usec << ' ' << ps.m_session << ' ' << ps.m_stream << ' ' << ps.m_sequence << std::endl;
+    }
+}
+
+
+bool YazSession::fileStamp(const ProbeStamp &ps, long long sent, long long now, float microthresh, int spacing)
+{
+    if (m_have_reported && int(ps.m_stream - m_reported) <= 0)
+    {
+        m_late++;
+        return false;
     }
 
-    m_app_probes.push_back(ps);
+    if (ps.m_sequence >= (unsigned int)YAZSLABCAP)
+    {
+        m_overflow++;
+        return false;
+    }
+
+    YazStreamSlab *slab = 0;
+    for (int i = 0; i < YAZSLABS && !slab; ++i)
+        if (m_slabs[i].m_used && m_slabs[i].m_stream == ps.m_stream)
+            slab = &m_slabs[i];
+    if (!slab)
+        slab = newSlab(ps.m_stream, now);
+
+    if (slab->m_seen.test(ps.m_sequence))
+    {
+        m_dups++;
+        return false;
+    }
+
+    slab->m_seen.set(ps.m_sequence);
+    slab->m_microthresh = microthresh;
+    slab->m_spacing = spacing;
+    slab->m_stamps.add(ps, sent);
+    slab->m_stats.add(ps, sent, microthresh, spacing);
+
+    // a delay that does not fit, or a probe without a departure time,
+    // is reported as negative like any other clock problem.
+    long long owd = -1;
+    if (sent)
+        owd = ps.m_ts.tv_sec * 1000000000LL + ps.m_ts.tv_usec * 1000LL - sent;
+    if (owd > INT_MAX || owd < INT_MIN)
+        owd = -1;
+    slab->m_delay[ps.m_sequence] = int(owd);
+    slab->m_touched = now;
+    return true;
 }
 
 
+void YazSession::drainStream(unsigned int stream, YazStamps &out,
+                             YazSpacingStats &stats, std::bitset<YAZSLABCAP> &seen,
+                             std::vector<int> &delays)
+{
+    out.clear();
+    stats.reset();
+    seen.reset();
+    delays.clear();
+    for (int i = 0; i < YAZSLABS; ++i)
+    {
+        YazStreamSlab *slab = &m_slabs[i];
+        if (!slab->m_used)
+            continue;
+
+        if (slab->m_stream == stream)
+        {
+            if (slab->m_stats.m_reorder > 0)
+            {
+                // the lanes of a multi-threaded sender don't keep strict
+                // order between them: put the stream back in sequence
+                // order and take its spacings again.
+                slab->m_stamps.sortBySequence();
+                slab->m_stats.reset();
+                ProbeStamp ps;
+                for (int j = 0; j < slab->m_stamps.size(); ++j)
+                {
+                    ps.m_sequence = slab->m_stamps.m_seq[j];
+                    ps.m_ts = slab->m_stamps.tv(j);
+                    slab->m_stats.add(ps, slab->m_stamps.m_sent[j], slab->m_microthresh, slab->m_spacing);
+                }
+            }
+            out.copy(slab->m_stamps);
+            stats = slab->m_stats;
+            seen = slab->m_seen;
+            delays.assign(slab->m_delay, slab->m_delay + YAZSLABCAP);
+            releaseSlab(slab);
+        }
+        else if (int(slab->m_stream - stream) < 0)
+        {
+            // the sender has moved past it, so nobody will ask.
+            releaseSlab(slab);
+            m_evicted++;
+        }
+    }
+
+    m_reported = stream;
+    m_have_reported = true;
+}
+
+
+YazStreamSlab *YazSession::newSlab(unsigned int stream, long long now)
+{
+    // drop streams that have been idle for YAZSLABAGE, then take a free
+    // slab or, failing that, the least recently used one.
+    YazStreamSlab *victim = 0;
+    for (int i = 0; i < YAZSLABS; ++i)
+    {
+        YazStreamSlab *slab = &m_slabs[i];
+        if (slab->m_used && now - slab->m_touched > YAZSLABAGE * 1000000LL)
+        {
+            releaseSlab(slab);
+            m_evicted++;
+        }
+
+        if (!victim || (victim->m_used && (!slab->m_used || slab->m_touched < victim->m_touched)))
+            victim = slab;
+    }
+
+    if (victim->m_used)
+    {
+        releaseSlab(victim);
+        m_evicted++;
+    }
+
+    victim->m_used = true;
+    victim->m_stream = stream;
+    victim->m_stamps.m_stream = stream;
+    victim->m_touched = now;
+    return victim;
+}
+
+
+void YazSession::releaseSlab(YazStreamSlab *slab)
+{
+    slab->m_used = false;
+    slab->m_stamps.clear();
+    slab->m_seen.reset();
+    slab->m_stats.reset();
+}
+
+
+#if HAVE_PCAP_H
+size_t YazReceiver::countPcapProbes(unsigned int id)
+{
+    size_t n = 0;
+    pthread_mutex_lock(m_pcap_mutex);
+    for (size_t i = 0; i < m_pcap_probes->size(); ++i)
+        if ((*m_pcap_probes)[i].m_session == id)
+            n++;
+    pthread_mutex_unlock(m_pcap_mutex);
+    return n;
+}
+#endif
+
+
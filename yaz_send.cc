@@ -32,6 +32,8 @@
 #include <float.h>
 #endif
 #include <math.h>
+#include <algorithm>
+#include <fcntl.h>
 
 void YazSender::prepCtrl()
 {
@@ -50,13 +52,20 @@ void YazSender::prepCtrl()
         std::cerr << "error connecting to receiver: " << errno << '/' << strerror(errno) << std::endl;
         throw -1;
     }
+    set_nodelay(m_ctrl_sd);
 }
 
 
 void YazSender::prepProbe()
 {
-    m_probe_sd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (m_probe_sd < 0)
+    m_probe_sd = openProbeSocket();
+}
+
+
+int YazSender::openProbeSocket()
+{
+    int sd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sd < 0)
         throw -1;
 
     struct sockaddr_in sin;
@@ -65,26 +74,45 @@ void YazSender::prepProbe()
     sin.sin_family = AF_INET;
     sin.sin_addr.s_addr = 0;
     sin.sin_port = 0;
-    if (bind(m_probe_sd, (const struct sockaddr*)&sin, sizeof(struct sockaddr_in)) < 0)
+    if (bind(sd, (const struct sockaddr*)&sin, sizeof(struct sockaddr_in)) < 0)
     {
         std::cerr << "error binding local probe socket: " << errno << '/' << strerror(errno) << std::endl;
+        close(sd);
         throw -1;
     }
    
     sin.sin_family = AF_INET;
     memcpy(&sin.sin_addr, &m_target_addr, sizeof(struct in_addr));
     sin.sin_port = htons(DEST_PORT);
-    if (connect(m_probe_sd, (const struct sockaddr *)&sin, sizeof(struct sockaddr_in)) < 0)
+    if (connect(sd, (const struct sockaddr *)&sin, sizeof(struct sockaddr_in)) < 0)
     {
         std::cerr << "error connecting probe socket to remote: " << errno << '/' << strerror(errno) << std::endl;
+        close(sd);
         throw -1;
 
     }
+    return (sd);
 }
 
 
 void YazSender::cleanup()
 {
+    stopPacer();
+    releaseLatency();
+    m_probe_buf = 0;
+#if HAVE_FRAME_TX
+    delete m_txring;
+    m_txring = 0;
+#endif
+#if HAVE_IO_URING
+    delete m_ring;
+    m_ring = 0;
+    m_ring_buf = 0;
+#endif
+    // hand the stamps back to the arena before it goes.
+    YazStampVec().swap(m_app_probes);
+    m_arena.close();
+
     close (m_probe_sd);
     close (m_ctrl_sd);
  
@@ -114,17 +142,16 @@ void print_delay_vec(const std::vector<timeval>& delay_vec){
 }
 
 
-// Assumes clock synchronized
-std::vector<timeval> YazSender::make_delays_vec(const std::vector<ProbeStamp>& remote_probes){
-    std::vector<timeval> res;
-    res.reserve(m_app_probes.size());
+// Assumes clock synchronized.  fills res, which keeps its capacity.
+void YazSender::make_delays_vec(const YazStamps& remote_probes, std::vector<timeval>& res){
+    res.clear();
     struct timeval diff;
     struct timeval zero = {0, 0};
     int j = 0;
 
     for (int i = 0; i < remote_probes.size(); i++, j++) { // assume that remote_probes.size() <= m_app_probes.size()
         while (j < m_app_probes.size() && 
-               remote_probes[i].m_sequence != m_app_probes[j].m_sequence)
+               remote_probes.m_seq[i] != m_app_probes[j].m_sequence)
         {  // something is lost (no reordering!)
             //std::cout << "remote seq_n: " << remote_probes[i].m_sequence << "; local seq_n: ";
             //std::cout << m_app_probes[j].m_sequence << std::endl;
@@ -133,7 +160,10 @@ std::vector<timeval> YazSender::make_delays_vec(const std::vector<ProbeStamp>& r
             diff.tv_usec = 0;
             res.push_back(diff);
         }
-        timersub(&(remote_probes[i].m_ts), &(m_app_probes[i].m_ts), &diff);
+        if (j >= m_app_probes.size())
+            break;
+        struct timeval arrival = remote_probes.tv(i);
+        timersub(&arrival, &(m_app_probes[j].m_ts), &diff);
         if (timercmp(&diff, &zero, <)){ // clock problems...
             diff.tv_sec = -1;
             diff.tv_usec = 0;
@@ -148,11 +178,10 @@ std::vector<timeval> YazSender::make_delays_vec(const std::vector<ProbeStamp>& r
         res.push_back(diff);
     }
 
-    return res;
 }
 
 
-std::vector<timeval> get_send_time(const std::vector<ProbeStamp>& ps_vec){
+std::vector<timeval> get_send_time(const YazStampVec& ps_vec){
     std::vector<timeval> res;
     res.reserve(ps_vec.size());
     for (const auto& elem: ps_vec){
@@ -162,6 +191,41 @@ std::vector<timeval> get_send_time(const std::vector<ProbeStamp>& ps_vec){
 }
 
 
+// tell the receiver a stream is on its way and how long it should
+// take, so that it can busy-poll for it.  no reply is expected.
+void YazSender::announceStream()
+{
+    if (!m_announce)
+        return;
+
+    YazCtrlMsg pmsg;
+    pmsg.m_code = htonl(PCTRL_STREAM);
+    pmsg.m_len = 0;
+    pmsg.m_ps_vec_len = 0;
+    pmsg.m_seq = htonl(m_ctrl_seq);
+    pmsg.m_reason = htonl((unsigned int)m_stream_length * (m_target_spacing + m_min_sleep));
+    pmsg.m_session = htonl(m_session);
+    pmsg.m_stream = htonl(m_curr_stream);
+    pmsg.m_report = htonl(m_round_report);
+
+    int remain = sizeof(pmsg);
+    int offset = 0;
+    while (remain)
+    {
+        int n = send(m_ctrl_sd, ((char*)&pmsg)+offset, remain, 0);
+        if (n <= 0)
+        {
+            // the RST that follows the stream will hit this too.
+            std::cerr << "!!error on send() of stream notice: " << errno << '/' << strerror(errno) << std::endl;
+            return;
+        }
+
+        remain -= n;
+        offset += n;
+    }
+}
+
+
 // After collectRemote we have m_app_probes clear (and processed)
 bool YazSender::collectRemote(MeasurementBundle &mb)
 {
@@ -173,6 +237,9 @@ bool YazSender::collectRemote(MeasurementBundle &mb)
     pmsg.m_ps_vec_len = 0;
     pmsg.m_seq = htonl(m_ctrl_seq);
     pmsg.m_reason = 0;
+    pmsg.m_session = htonl(m_session);
+    pmsg.m_stream = htonl(m_curr_stream);
+    pmsg.m_report = htonl(m_round_report);
 
     int remain = sizeof(pmsg);
     int offset = 0;
@@ -223,6 +290,16 @@ bool YazSender::collectRemote(MeasurementBundle &mb)
                 offset += n;
             }
 
+            if (ntohl(pmsg.m_code) == PCTRL_INVALID && m_announce)
+            {
+                // an older receiver refusing a stream notice.  the
+                // RST-ACK is still to come.
+                if (m_verbose)
+                    std::cout << "!! (non-fatal) receiver doesn't take stream notices - no longer sending them" << std::endl;
+                m_announce = false;
+                continue;
+            }
+
             if (ntohl(pmsg.m_code) == PCTRL_RST_NACK)
             {
                 if (m_verbose)
@@ -237,7 +314,12 @@ bool YazSender::collectRemote(MeasurementBundle &mb)
 
             // receive YazRstResponse
             remain = ntohl(pmsg.m_len);
-            YazRstResponse *yrr = new YazRstResponse();
+            if (remain != int(sizeof(YazRstResponse)))
+            {
+                std::cerr << "!!bad RST-ACK payload length: " << remain << std::endl;
+                return false;
+            }
+            YazRstResponse *yrr = &m_rst_reply;
             char *buffer = (char *)yrr;
             offset = 0; 
             while (remain > 0)
@@ -253,12 +335,13 @@ bool YazSender::collectRemote(MeasurementBundle &mb)
                 offset += n;
             }
 
-            // receive std::vector<ProbeStamp> for delays
+            // receive std::vector<ProbeStamp> for delays, or the loss
+            // bitmap, depending on the report level granted
             int remain_ps_vec = ntohl(pmsg.m_ps_vec_len);
             remain = remain_ps_vec;
-            if (remain > 0){
-                buffer = new char[remain];
-            }
+            if (remain > int(m_report_buf.size()))
+                m_report_buf.resize(remain);
+            buffer = &m_report_buf[0];
             offset = 0;
             while (remain > 0)
             {
@@ -272,12 +355,61 @@ bool YazSender::collectRemote(MeasurementBundle &mb)
                 remain -= n;
                 offset += n;
             }
-            if (remain_ps_vec > 0){
-                PsVec::SendProbeStampVec sps_vec;
-                sps_vec.ParseFromString(std::string(buffer));
-                std::vector<ProbeStamp> ps_vec = std::move(deserialize_psvec(sps_vec));
-                mb.m_delays_vec = std::move(make_delays_vec(ps_vec));
-                if (m_verbose > 1 && m_app_probes.size() != ps_vec.size()){
+            m_remote_seen_len = 0;
+            if (remain_ps_vec > 0 && ntohl(pmsg.m_report) == PREPORT_DELAYS){
+                // the receiver worked out the delays from the departure
+                // times in the probes; no need to match up stamps.
+                unsigned int nb = 0;
+                int mapoff = sizeof(nb);
+                if (remain_ps_vec >= mapoff)
+                    memcpy(&nb, buffer, sizeof(nb));
+                int nbits = std::min(int(ntohl(nb)), YAZSLABCAP);
+                int nbytes = (nbits + 7) / 8;
+                const char *dp = buffer + mapoff + nbytes;
+                const char *end = buffer + remain_ps_vec;
+
+                m_remote_seen.reset();
+                m_remote_seen_len = (mapoff + nbytes <= remain_ps_vec) ? nbits : 0;
+                mb.m_delays_vec.clear();
+                for (int i = 0; i < m_stream_length; ++i){
+                    struct timeval d = {-1, 0};
+                    if (i < m_remote_seen_len && (buffer[mapoff + i / 8] & (1 << (i % 8))) && dp + sizeof(int) <= end){
+                        int ns = 0;
+                        memcpy(&ns, dp, sizeof(ns));
+                        dp += sizeof(ns);
+                        ns = ntohl(ns);
+                        m_remote_seen.set(i);
+                        if (ns >= 0){
+                            d.tv_sec = ns / 1000000000;
+                            d.tv_usec = (ns % 1000000000) / 1000;
+                        }
+                    }
+                    mb.m_delays_vec.push_back(d);
+                }
+                if (m_verbose > 1 && int(m_remote_seen.count()) < m_stream_length){
+                    std::cout << "Lost packets!:" << std::endl;
+                    print_delay_vec(mb.m_delays_vec);
+                }
+            }
+            else if (remain_ps_vec > 0 && ntohl(pmsg.m_report) == PREPORT_LOSSMAP){
+                m_remote_seen.reset();
+                m_remote_seen_len = std::min(remain_ps_vec * 8, YAZSLABCAP);
+                for (int i = 0; i < m_remote_seen_len; ++i)
+                    if (buffer[i / 8] & (1 << (i % 8)))
+                        m_remote_seen.set(i);
+                if (m_verbose > 1 && int(m_remote_seen.count()) < m_stream_length){
+                    std::cout << "Lost packets!:";
+                    for (int i = 0; i < m_stream_length; ++i)
+                        if (i >= m_remote_seen_len || !m_remote_seen.test(i))
+                            std::cout << ' ' << i;
+                    std::cout << std::endl;
+                }
+            }
+            else if (remain_ps_vec > 0){
+                if (!m_psvec.decode(buffer, remain_ps_vec, m_remote_probes))
+                    std::cerr << "!! (non-fatal) couldn't parse receiver's stamps" << std::endl;
+                make_delays_vec(m_remote_probes, mb.m_delays_vec);
+                if (m_verbose > 1 && m_app_probes.size() != size_t(m_remote_probes.size())){
                     std::cout << "Lost packets!:" << std::endl;
                     print_delay_vec(mb.m_delays_vec);
                 }                
@@ -289,6 +421,8 @@ bool YazSender::collectRemote(MeasurementBundle &mb)
             mb.m_remote_ttl = ntohl(yrr->m_ttl);
             mb.m_remote_nsamples = ntohl(yrr->m_nsamples);
             mb.m_remote_nlost = ntohl(yrr->m_nlost);
+            if (mb.m_remote_nlost > 0)
+                m_round_losses = true;
 
             float mean = 0;
             int nsamp = 0;
@@ -368,9 +502,11 @@ bool YazSender::collectRemote(MeasurementBundle &mb)
 
 bool YazSender::doOneMeasurementRound(std::list<MeasurementBundle> *mb_list)
 {
-    MeasurementBundle mb;
+    MeasurementBundle &mb = m_stream_mb;
 
     int maxattempt = m_nstreams;
+    int resends = 0;
+    m_round_kept_bad = 0;
 
     int streamnum = 1;
     while (streamnum <= m_nstreams && maxattempt)
@@ -379,7 +515,10 @@ bool YazSender::doOneMeasurementRound(std::list<MeasurementBundle> *mb_list)
 
         gettimeofday(&mb.m_start, 0);
         m_curr_stream++;
-        sendStream();
+        announceStream();
+        runStream();
+        m_local_sent++;
+        bool local_ok = localStreamConsistent();
         gettimeofday(&mb.m_end, 0);
 
         usleep(2000);
@@ -390,6 +529,21 @@ bool YazSender::doOneMeasurementRound(std::list<MeasurementBundle> *mb_list)
             continue;
         }
 
+        // a stream that left badly spaced says nothing about the path;
+        // send it again, a few times, before settling for it.
+        if (!local_ok)
+        {
+            if (resends < YAZLOCALRESENDS)
+            {
+                resends++;
+                m_local_resent++;
+                continue;
+            }
+            m_local_kept++;
+            m_round_kept_bad++;
+        }
+        resends = 0;
+
         if (int(mb.m_remote_nlost) > 1 && m_verbose)
         {
             std::cout << "## pkts lost --- backing off: " << mb.m_remote_nlost << std::endl;
@@ -406,8 +560,12 @@ bool YazSender::doOneMeasurementRound(std::list<MeasurementBundle> *mb_list)
         if (m_verbose > 1)
             std::cout << "Yaz nsamples: " << mb.m_remote_nsamples << std::endl;
 
-        MeasurementBundle bx = mb;
-        mb_list->push_back(bx);
+        // reuse a bundle from an earlier round: its delay vector
+        // already has the capacity.
+        if (m_spare_mbs.empty())
+            m_spare_mbs.push_back(MeasurementBundle());
+        mb_list->splice(mb_list->end(), m_spare_mbs, m_spare_mbs.begin());
+        mb_list->back() = mb;
         streamnum++;
 
         maxattempt = m_nstreams;
@@ -475,25 +633,109 @@ bool YazSender::isPathSame(std::list<MeasurementBundle> *mblist)
 
 
 
+// a stream that leaves badly spaced is resent (see doOneMeasurementRound());
+// a round that still had to keep one isn't fit to estimate from.
 bool YazSender::localSpacingConsistent(std::list<MeasurementBundle> *mblist)
 {
-    bool rv = true;
+    bool rv = (m_round_kept_bad == 0);
+    if (!rv)
+        std::cout << "!! error: inconsistent local spacing in " << m_round_kept_bad << " of " << mblist->size() << " streams." << std::endl;
+    return (rv);
+}
+
+
+// transmit times only say something about spacing when each probe is
+// a send of its own on a udp socket.
+bool YazSender::perProbeSends()
+{
+#if HAVE_FRAME_TX
+    if (m_txring)
+        return (false);
+#endif
+    return (!m_gso);
+}
+
+
+// probes of a stream that a lane sends.
+int YazSender::lanePlanned(YazPacerLane *lane)
+{
+    int nlanes = m_pacer->m_lanes.size();
+    return ((m_stream_length - lane->m_index + nlanes - 1) / nlanes);
+}
+
 
-#if 0 // FIXME
-    for (std::list<MeasurementBundle>::iterator iterI = mblist->begin();
-         iterI != mblist->end(); ++iterI)
+// did the stream just sent leave the way it was paced?  not if the
+// qdisc dropped any of it, nor if its transmit times are off the target
+// spacing on average by more than YAZLOCALSLACK of it, or show more
+// than YAZLOCALBUNCH percent of the gaps closed up to under half of it.
+// without a full set of transmit times, a backlog still under the
+// socket at the end of the stream is taken as the sign of bunching.
+bool YazSender::localStreamConsistent()
+{
+    int drops = m_tx_drops;
+    int outq = 0;
+    int ntx = 0;
+    bool complete = perProbeSends();
+    for (size_t i = 0; i < m_pacer->m_lanes.size(); ++i)
     {
-        if (fabs(iterI->m_local_pcap_mean - m_target_spacing) >
-            std::max(2.0f, (m_threshold * m_target_spacing)))
+        YazPacerLane *lane = m_pacer->m_lanes[i];
+        outq = std::max(outq, lane->m_outq);
+        if (!lane->m_watch.stamping() || lane->m_ntx < lanePlanned(lane))
+            complete = false;
+        else
         {
-            std::cout << "!! error: inconsistent local spacing." << std::endl;
-            rv = false;
-            break;
+            memcpy(m_local_tx + ntx, lane->m_tx, lane->m_ntx * sizeof(long long));
+            ntx += lane->m_ntx;
         }
     }
-#endif
 
-    return (rv);
+    bool ok = (drops == 0 && !m_pacer->m_late);
+    double mean = 0;
+    int bunched = 0;
+    if (complete && ntx > 1)
+    {
+        if (m_pacer->m_lanes.size() > 1)
+            std::sort(m_local_tx, m_local_tx + ntx);
+        mean = (m_local_tx[ntx - 1] - m_local_tx[0]) / 1000.0 / (ntx - 1);
+        long long half = m_target_spacing * 500LL;
+        for (int i = 1; i < ntx; ++i)
+            if (m_local_tx[i] - m_local_tx[i - 1] < half)
+                bunched++;
+        ok = ok && fabs(mean - m_target_spacing) <= std::max(2.0, double(YAZLOCALSLACK * m_target_spacing));
+        ok = ok && bunched * 100 <= YAZLOCALBUNCH * (ntx - 1);
+    }
+    else
+    {
+        // the kernel counts buffer overhead in with the probes.
+        ok = ok && outq <= YAZOUTQPROBES * m_curr_pkt_size;
+    }
+
+    if (m_verbose > 1)
+    {
+        std::cout << "##local stream " << m_curr_stream << " (target " << m_target_spacing << "): ";
+        if (complete)
+            std::cout << "tx stamps " << ntx << " mean gap " << mean << " bunched " << bunched;
+        else
+            std::cout << "no tx stamps";
+        std::cout << " outq " << outq << " drops " << drops << (m_pacer->m_late ? " late" : "") << (ok ? "" : " - badly spaced") << std::endl;
+    }
+    return (ok);
+}
+
+
+void YazSender::newSession()
+{
+    // the receiver may be serving other senders; pick an id that
+    // is unlikely to collide with theirs.
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    m_session = (unsigned int)(tv.tv_sec * 1000003) ^ (unsigned int)(tv.tv_usec << 12) ^ (unsigned int)getpid();
+    m_session = (m_session * 2654435761U) ^ (unsigned int)random();
+    if (m_session == 0)
+        m_session = 1;
+
+    if (m_verbose)
+        std::cout << "##session id: " << m_session << std::endl;
 }
 
 
@@ -509,12 +751,15 @@ void YazSender::setupRun(){
 #endif
 
     // setup control, probe, pcap
+    newSession();
     prepCtrl();
     prepProbe();
 #if HAVE_PCAP_H
     prepPcap();
 #endif
 
+    m_report_buf.resize(YAZREPORTBUFLEN);
+
     // send RST as a ping and to clean out any measurements from remote side
     if (!resetRemote())
     {
@@ -523,6 +768,27 @@ void YazSender::setupRun(){
     }
 
     _m_saved_pkt_size = m_curr_pkt_size;
+
+    // packet size only shrinks from here, so one payload buffer of the
+    // initial size serves every stream.  it and the stamp vectors come
+    // from the arena, so they are faulted in and locked now rather
+    // than inside the first timed loop.
+    m_probe_buf_len = std::max(int(sizeof(YazPkt)), m_curr_pkt_size - int(sizeof(struct ip) + sizeof(struct udphdr)));
+    if (m_gso)
+        m_probe_buf_len = std::min(YAZGSOSEGS * m_probe_buf_len, YAZGSOMAX);
+    if (!m_arena.open(arenaSize(), m_verbose))
+        throw -1;
+    m_probe_buf = (char *)m_arena.take(m_probe_buf_len);
+    YazStampVec(YazArenaAlloc<ProbeStamp>(&m_arena)).swap(m_app_probes);
+    m_app_probes.reserve(m_stream_length);
+    m_gaps.reserve(m_stream_length);
+    m_stream_mb.m_delays_vec.reserve(YAZSLABCAP);
+    m_round_mb.m_delays_vec.reserve(YAZSLABCAP);
+
+    prepTxRing();
+    prepUring();
+    startPacer();
+
     _m_fastest_local = MAX_SPACE;
     _m_max_space = std::max( int(float(m_min_pkt_size * 8) / m_resolution), MAX_SPACE);
     std::cout << "## setting max_space to be " << _m_max_space << std::endl;
@@ -530,9 +796,52 @@ void YazSender::setupRun(){
 }
 
 
-void YazSender::sleepExponentially(){
-    int sleeptime = int(-1 * (m_inter_stream_spacing/1000) * log(1.0 - (random() / double(INT_MAX))));
-    usleep(sleeptime * 1000);
+// exponentially distributed sleep with a mean of scale inter-stream
+// spacings, in usecs.  a backed-off sleep (scale > 1) is capped at
+// MAX_SLEEP_MEANS means, since at the largest back-off the unbounded
+// draw could leave the path unmeasured for far too long; retries and
+// the base rate keep the plain draw.
+void YazSender::sleepExponentially(int scale){
+    double u = (random() + 1.0) / (double(INT_MAX) + 2.0);
+    double mean = double(m_inter_stream_spacing) * scale;
+    double draw = -mean * log(u);
+    if (scale > 1)
+        draw = std::min(draw, mean * MAX_SLEEP_MEANS);
+    long long sleeptime = (long long)draw;
+
+    struct timespec ts;
+    ts.tv_sec = sleeptime / 1000000LL;
+    ts.tv_nsec = (sleeptime % 1000000LL) * 1000;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+
+void YazSender::adaptEstimationInterval()
+{
+    // back off exponentially while the estimates look stationary, and
+    // go back to the base rate as soon as the detector flags a shift.
+    // a sample that came to no estimate (too little avbw, local spacing
+    // that never came right, or retries run out) says nothing about the
+    // level, so it leaves both the detector and the back-off alone.
+    if (!m_estimated || m_curr_estimation <= 0)
+        return;
+
+    if (m_change.update(m_curr_estimation, m_resolution))
+    {
+        if (m_verbose)
+            std::cout << "## path change detected --- resetting estimation interval" << std::endl;
+        m_change.reset();
+        m_change.update(m_curr_estimation, m_resolution);
+        m_backoff = 1;
+    }
+    else
+    {
+        m_backoff = std::min(m_backoff * 2, m_max_backoff);
+    }
+
+    if (m_verbose > 1)
+        std::cout << "## estimation back-off: " << m_backoff << std::endl;
 }
 
 // clears mb_list
@@ -543,7 +852,15 @@ bool YazSender::processOneRoundRes(std::list<MeasurementBundle> *mb_list){
         throw -1;
     }
 
-    MeasurementBundle mb;
+    if (!localSpacingConsistent(mb_list))
+    {
+        // try the round again, within the usual retry limit.
+        m_local_discarded++;
+        m_spare_mbs.splice(m_spare_mbs.end(), *mb_list);
+        return (--_m_local_crawl <= 0);
+    }
+
+    MeasurementBundle &mb = m_round_mb;
     coalesceMeasurements(mb_list, mb);
     m_traffic_generated += mb.m_local_nsamples * m_curr_pkt_size * 8;
 #if 0
@@ -559,11 +876,22 @@ bool YazSender::processOneRoundRes(std::list<MeasurementBundle> *mb_list){
     // or expansion that allows the rate to be within our target resolution (with
     // a minimum of 2 microseconds, which only matters at rather fast probe rates.)
     //
-    float curr_rate = ((m_curr_pkt_size * 8.0) / mb.m_local_pcap_mean) * 1000000;
-    float resol_spc = (m_curr_pkt_size * 8.0) / (curr_rate - m_resolution) * 1000000 - mb.m_local_pcap_mean;
-    float maxdiff = std::max(1.0f, resol_spc);
-    bool compexp =  
-        (fabs(mb.m_remote_pcap_mean - mb.m_local_pcap_mean) > maxdiff);
+    // a UDP_SEGMENT train at MIN_SPACE_GSO leaves with every local
+    // stamp the same, so there is no local rate to hold the remote
+    // spacing against.  such a train is always taken as expanded: it
+    // only tells the next, paced, stream where to start.
+    float curr_rate = 0;
+    bool compexp = true;
+    if (mb.m_local_pcap_mean > 0)
+    {
+        curr_rate = ((m_curr_pkt_size * 8.0) / mb.m_local_pcap_mean) * 1000000;
+        float resol_spc = (m_curr_pkt_size * 8.0) / (curr_rate - m_resolution) * 1000000 - mb.m_local_pcap_mean;
+        float maxdiff = std::max(1.0f, resol_spc);
+        compexp =
+            (fabs(mb.m_remote_pcap_mean - mb.m_local_pcap_mean) > maxdiff);
+    }
+    else if (mb.m_remote_pcap_mean > 0)
+        curr_rate = ((m_curr_pkt_size * 8.0) / mb.m_remote_pcap_mean) * 1000000;
 
     // force lower rate if there's packet loss
     compexp = compexp || (mb.m_remote_nlost > 1);
@@ -628,6 +956,7 @@ bool YazSender::processOneRoundRes(std::list<MeasurementBundle> *mb_list){
     else
     {   
         m_curr_estimation = (float(m_curr_pkt_size) * 8.0 ) / (mb.m_local_pcap_mean / 1000000.0);
+        m_estimated = true;
         done = true;
         if (m_verbose > 1)
             std::cout << "## done. setting current estimate to " << m_curr_estimation / 1000.0 << std::endl;
@@ -638,9 +967,10 @@ bool YazSender::processOneRoundRes(std::list<MeasurementBundle> *mb_list){
 #endif
     }
 
-    mb_list->clear();
+    m_spare_mbs.splice(m_spare_mbs.end(), *mb_list);
     if (_m_local_crawl <= 0){
         m_curr_estimation = curr_rate;
+        m_estimated = false;
         done = true; // force stop
     }
 
@@ -650,10 +980,389 @@ bool YazSender::processOneRoundRes(std::list<MeasurementBundle> *mb_list){
 
 
 void YazSender::resetRound(){
-    m_target_spacing = MIN_SPACE;
+    m_target_spacing = minSpace();
     m_curr_pkt_size = _m_saved_pkt_size;
     _m_local_crawl = RETRY_LIMIT;
     m_traffic_generated = 0;
+    m_estimated = false;
+
+    // choose this round's report level.  when only summaries are
+    // wanted, a round after one that lost probes also asks for the
+    // loss bitmap so that the losses can be located.
+    m_round_report = m_report_level;
+    if (m_report_level == PREPORT_SUMMARY && m_round_losses)
+        m_round_report = PREPORT_LOSSMAP;
+    m_round_losses = false;
+}
+
+
+void YazSender::prepTxRing()
+{
+#if HAVE_FRAME_TX
+    bool ok = false;
+#if HAVE_AF_XDP
+    if (m_tx_mode == PTX_XDP)
+    {
+        YazXskTx *xtx = new YazXskTx();
+        m_txring = xtx;
+        ok = xtx->open(m_probe_sd, m_stream_length, m_verbose);
+    }
+#endif
+#if HAVE_PACKET_TX_RING
+    if (m_tx_mode == PTX_RING || m_tx_mode == PTX_RING_BYPASS)
+    {
+        YazTxRing *ring = new YazTxRing();
+        m_txring = ring;
+        ok = ring->open(m_probe_sd, m_stream_length, m_curr_pkt_size, m_tx_mode == PTX_RING_BYPASS, m_verbose);
+    }
+#endif
+    if (m_tx_mode != PTX_SOCKET && !ok)
+    {
+        std::cerr << "!! (non-fatal) probe frame backend unavailable - sending probes through udp socket" << std::endl;
+        delete m_txring;
+        m_txring = 0;
+        m_tx_mode = PTX_SOCKET;
+    }
+#endif
+}
+
+
+void YazSender::prepUring()
+{
+#if HAVE_IO_URING
+    if (!m_uring)
+        return;
+
+    m_ring = new YazUring();
+    if (!m_ring->open(YAZURINGENTRIES, m_verbose))
+    {
+        std::cerr << "!! (non-fatal) io_uring unavailable - using the default I/O engine" << std::endl;
+        delete m_ring;
+        m_ring = 0;
+        m_uring = false;
+        return;
+    }
+
+    // two entries (timeout and send) per probe in flight.
+    int nslots = YAZURINGENTRIES / 2;
+    m_ring_buf = (char *)m_arena.take(nslots * m_probe_buf_len);
+#endif
+}
+
+
+// enough arena for every per-stream buffer: a probe payload for each
+// pacing lane and each io_uring send in flight, and room for a whole
+// stream's stamps in m_app_probes and again across the lanes, and for
+// its transmit times likewise.  each piece may lose a cache line to
+// alignment.
+size_t YazSender::arenaSize()
+{
+    size_t nbufs = m_nlanes;
+#if HAVE_IO_URING
+    if (m_uring)
+        nbufs += YAZURINGENTRIES / 2;
+#endif
+    size_t nstamps = m_stream_length + m_nlanes * (m_stream_length / m_nlanes + 1);
+    return nbufs * m_probe_buf_len + nstamps * (sizeof(ProbeStamp) + sizeof(long long)) +
+        (nbufs + 2 * m_nlanes + 2) * 64;
+}
+
+
+extern "C"
+{
+    void *pacer_thread_entry(void *arg)
+    {
+        YazPacerLane *lane = static_cast<YazPacerLane*>(arg);
+        lane->m_sender->pacerLoop(lane);
+        return (0);
+    }
+}
+
+
+void YazSender::startPacer()
+{
+    if (m_realtime)
+    {
+#if HAVE_MLOCKALL
+        // keep the pacing thread from ever waiting on a page fault.
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+            std::cerr << "!! (non-fatal) couldn't lock memory: " << errno << '/' << strerror(errno) << std::endl;
+#endif
+    }
+
+    int ncpus = 1;
+#if HAVE_SYSCONF
+    ncpus = std::max(1, int(sysconf(_SC_NPROCESSORS_ONLN)));
+#endif
+
+    m_pacer = new YazPacerCtrl();
+    for (int i = 0; i < m_nlanes; ++i)
+    {
+        YazPacerLane *lane = new YazPacerLane();
+        lane->m_index = i;
+        lane->m_sender = this;
+        if (m_pacer_cpu >= 0)
+            lane->m_cpu = (m_pacer_cpu + i) % ncpus;
+        YazStampVec(YazArenaAlloc<ProbeStamp>(&m_arena)).swap(lane->m_stamps);
+        lane->m_stamps.reserve(m_stream_length / m_nlanes + 1);
+        lane->m_tx = (long long *)m_arena.take((m_stream_length / m_nlanes + 1) * sizeof(long long));
+        m_pacer->m_lanes.push_back(lane);
+
+        if (i == 0)
+        {
+            lane->m_sd = m_probe_sd;
+            lane->m_buf = m_probe_buf;
+        }
+        else
+        {
+            lane->m_sd = openProbeSocket();
+            lane->m_buf = (char *)m_arena.take(m_probe_buf_len);
+        }
+        lane->m_watch.open(lane->m_sd, m_verbose);
+    }
+    m_local_tx = (long long *)m_arena.take(m_stream_length * sizeof(long long));
+
+    for (int i = 0; i < m_nlanes; ++i)
+    {
+        YazPacerLane *lane = m_pacer->m_lanes[i];
+        if (pthread_create(&lane->m_thread, NULL, pacer_thread_entry, lane) != 0)
+        {
+            std::cerr << "!!error spawning pacing thread: " << errno << '/' << strerror(errno) << std::endl;
+            m_pacer->m_lanes.resize(i);
+            stopPacer();
+            throw -1;
+        }
+    }
+}
+
+
+void YazSender::stopPacer()
+{
+    if (!m_pacer)
+        return;
+
+    pthread_mutex_lock(&m_pacer->m_mutex);
+    m_pacer->m_exit = true;
+    pthread_cond_broadcast(&m_pacer->m_cond);
+    pthread_mutex_unlock(&m_pacer->m_mutex);
+
+    for (size_t i = 0; i < m_pacer->m_lanes.size(); ++i)
+    {
+        YazPacerLane *lane = m_pacer->m_lanes[i];
+        pthread_join(lane->m_thread, NULL);
+        if (lane->m_index > 0)
+        {
+            close(lane->m_sd);
+        }
+        delete lane;
+    }
+    delete m_pacer;
+    m_pacer = 0;
+}
+
+
+void YazSender::pacerLoop(YazPacerLane *lane)
+{
+    // everything that sets up the pacing thread happens here, off the
+    // timed path: timer slack, cpu affinity, real-time priority, and
+    // faulting in enough stack for sendStream().
+    set_timer_slack(m_verbose);
+
+#if HAVE_PTHREAD_SETAFFINITY_NP
+    if (lane->m_cpu >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(lane->m_cpu, &cpus);
+        int rv = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+        if (rv != 0)
+            std::cerr << "!! (non-fatal) couldn't pin pacing thread " << lane->m_index << " to cpu " << lane->m_cpu << ": " << rv << '/' << strerror(rv) << std::endl;
+        else if (m_verbose)
+            std::cout << "##pacing thread " << lane->m_index << " pinned to cpu " << lane->m_cpu << std::endl;
+    }
+#endif
+
+#if HAVE_SCHED_SETSCHEDULER
+    if (m_realtime)
+    {
+        // one below the maximum so that the watchdog (the control
+        // thread, raised to the maximum by runStream() while a stream
+        // is out) and kernel threads at max priority can still preempt us.
+        struct sched_param sp;
+        memset(&sp, 0, sizeof(sp));
+        sp.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+        int rv = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+        if (lane->m_index == 0)
+        {
+            if (rv == 0)
+                std::cout << "using real-time fifo scheduler for pacing thread." << std::endl;
+            else
+                std::cout << "using default scheduler for pacing thread." << std::endl;
+        }
+    }
+#endif
+
+    {
+        volatile char stack[PACER_STACK_PREFAULT];
+        memset((char *)stack, 0, PACER_STACK_PREFAULT);
+    }
+
+    pthread_mutex_lock(&m_pacer->m_mutex);
+    while (1)
+    {
+        while (!m_pacer->m_exit && lane->m_done == m_pacer->m_requested)
+            pthread_cond_wait(&m_pacer->m_cond, &m_pacer->m_mutex);
+        if (m_pacer->m_exit)
+            break;
+        int req = m_pacer->m_requested;
+        long long start = m_pacer->m_start;
+        pthread_mutex_unlock(&m_pacer->m_mutex);
+
+        bool failed = false;
+        try
+        {
+            if (lane->m_index == 0)
+                sendWarmup(lane->m_sd, lane->m_buf, m_curr_pkt_size - sizeof(struct ip) - sizeof(struct udphdr));
+            lane->m_watch.discard();
+            if (m_pacer->m_lanes.size() == 1)
+                sendStream();
+            else
+                sendLane(lane, start);
+
+            lane->m_outq = lane->m_watch.outq();
+            lane->m_ntx = 0;
+            if (perProbeSends())
+                lane->m_ntx = lane->m_watch.collect(lane->m_tx, lanePlanned(lane), YAZTXSTAMPWAIT);
+        }
+        catch (...)
+        {
+            failed = true;
+        }
+
+        pthread_mutex_lock(&m_pacer->m_mutex);
+        lane->m_done = req;
+        m_pacer->m_failed |= failed;
+        int nlanes = int(m_pacer->m_lanes.size());
+        // lane 0 is always the last to check in, so that it can go on
+        // to recalibrate once nobody is reading the calibration.
+        if (lane->m_index == 0)
+        {
+            while (m_pacer->m_lanes_done < nlanes - 1)
+                pthread_cond_wait(&m_pacer->m_cond, &m_pacer->m_mutex);
+        }
+        if (++m_pacer->m_lanes_done == nlanes)
+        {
+            m_pacer->m_lanes_done = 0;
+            m_pacer->m_completed++;
+        }
+
+        // recalibration belongs to the thread (and cpu and timer slack)
+        // that does the pacing.  it runs after the stream is handed
+        // back, between streams: runStream() holds the next one until
+        // it is done.
+        bool recal = (lane->m_index == 0 && m_recal_interval > 0 && ++m_streams_since_recal >= m_recal_interval);
+        m_pacer->m_recalibrating = recal;
+        pthread_cond_broadcast(&m_pacer->m_cond);
+        if (recal)
+        {
+            pthread_mutex_unlock(&m_pacer->m_mutex);
+            recalibrate(true);
+            m_streams_since_recal = 0;
+            pthread_mutex_lock(&m_pacer->m_mutex);
+            m_pacer->m_recalibrating = false;
+            pthread_cond_broadcast(&m_pacer->m_cond);
+        }
+    }
+    pthread_mutex_unlock(&m_pacer->m_mutex);
+}
+
+
+void YazSender::runStream()
+{
+    // hand one stream to the pacing thread and wait for it.  if the
+    // stream overruns its expected duration by more than PACER_WATCHDOG
+    // milliseconds, the pacing thread is knocked back to the default
+    // scheduler so that a runaway real-time thread can't starve the box.
+    // with several lanes, every lane is given the same start time a
+    // little in the future so that they all have woken up by then.
+    finishCalibration();
+    holdLatency();
+
+    // the watchdog is this thread.  while the stream is out it sits
+    // above the real-time pacing threads, so that a spinning one can't
+    // keep it off the cpu it needs to demote them.
+#if HAVE_SCHED_SETSCHEDULER
+    bool watchdog_rt = false;
+    int saved_policy = SCHED_OTHER;
+    struct sched_param saved_sp;
+    if (m_realtime && pthread_getschedparam(pthread_self(), &saved_policy, &saved_sp) == 0)
+    {
+        struct sched_param sp;
+        memset(&sp, 0, sizeof(sp));
+        sp.sched_priority = sched_get_priority_max(SCHED_FIFO);
+        watchdog_rt = (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp) == 0);
+    }
+#endif
+
+    pthread_mutex_lock(&m_pacer->m_mutex);
+    while (m_pacer->m_recalibrating)
+        pthread_cond_wait(&m_pacer->m_cond, &m_pacer->m_mutex);
+    m_tx_drops = 0;
+    m_pacer->m_failed = false;
+    m_pacer->m_late = false;
+    m_pacer->m_abort = false;
+    m_pacer->m_start = now_nsecs() + PACER_LANE_LEAD * 1000LL;
+    if (m_warmup)
+        m_pacer->m_start += YAZWARMUPLEAD * 1000LL;
+    m_pacer->m_requested++;
+    pthread_cond_broadcast(&m_pacer->m_cond);
+
+    long long budget = (long long)m_stream_length * (m_target_spacing + m_min_sleep) * 1000LL +
+        PACER_WATCHDOG * 1000000LL + PACER_LANE_LEAD * 1000LL;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    budget += deadline.tv_nsec;
+    deadline.tv_sec += budget / 1000000000LL;
+    deadline.tv_nsec = budget % 1000000000LL;
+
+    bool demoted = !m_realtime;
+    while (m_pacer->m_completed != m_pacer->m_requested)
+    {
+        int rv = demoted ? pthread_cond_wait(&m_pacer->m_cond, &m_pacer->m_mutex) :
+            pthread_cond_timedwait(&m_pacer->m_cond, &m_pacer->m_mutex, &deadline);
+        if (rv == ETIMEDOUT)
+        {
+            struct sched_param sp;
+            memset(&sp, 0, sizeof(sp));
+            for (size_t i = 0; i < m_pacer->m_lanes.size(); ++i)
+                pthread_setschedparam(m_pacer->m_lanes[i]->m_thread, SCHED_OTHER, &sp);
+            m_realtime = false;
+            demoted = true;
+            std::cerr << "!!pacing thread overran its stream --- watchdog dropped it to default scheduler" << std::endl;
+        }
+    }
+    bool failed = m_pacer->m_failed;
+    pthread_mutex_unlock(&m_pacer->m_mutex);
+
+#if HAVE_SCHED_SETSCHEDULER
+    if (watchdog_rt)
+        pthread_setschedparam(pthread_self(), saved_policy, &saved_sp);
+#endif
+    releaseLatency();
+    if (failed)
+        throw -1;
+
+    if (m_pacer->m_lanes.size() > 1)
+    {
+        // put the lanes' stamps back together as one stream.
+        for (size_t i = 0; i < m_pacer->m_lanes.size(); ++i)
+        {
+            YazStampVec &stamps = m_pacer->m_lanes[i]->m_stamps;
+            m_app_probes.insert(m_app_probes.end(), stamps.begin(), stamps.end());
+            stamps.clear();
+        }
+        std::sort(m_app_probes.begin(), m_app_probes.end(), by_sequence);
+    }
 }
 
 
@@ -669,11 +1378,11 @@ void YazSender::run()
         {
             struct timeval tvbegin;
             gettimeofday(&tvbegin, 0);
-            measurement_list->clear();
+            m_spare_mbs.splice(m_spare_mbs.end(), *measurement_list);
      
             resetRound();
             /* moved to resetRound
-            m_target_spacing = MIN_SPACE;
+            m_target_spacing = minSpace();
             m_curr_pkt_size = _m_saved_pkt_size;
             _m_local_crawl = RETRY_LIMIT;
             */
@@ -689,11 +1398,18 @@ void YazSender::run()
 #endif
             while (!done && _m_local_crawl)
             {
+#if HAVE_ALLOC_COUNT
+                long long nallocs = heap_allocations();
+#endif
                 if (!doOneMeasurementRound(measurement_list)){
                     std::cerr << "!! persistent error collecting measurements from receiver" << std::endl;
                     throw -1;
                 }
                 done = processOneRoundRes(measurement_list);
+#if HAVE_ALLOC_COUNT
+                if (m_verbose > 1)
+                    std::cout << "##heap allocations this round: " << heap_allocations() - nallocs << std::endl;
+#endif
 
                 if (!done){
                     sleepExponentially();   // retry
@@ -714,9 +1430,13 @@ void YazSender::run()
                       << std::fixed
                       << m_curr_estimation / 1000.0 << std::endl;
 
+            if (m_verbose)
+                std::cout << "## local stream checks: " << m_local_resent << " of " << m_local_sent << " streams resent, " << m_local_kept << " kept badly spaced, " << m_local_discarded << " rounds discarded" << std::endl;
+
             runnum++;
+            adaptEstimationInterval();
             m_curr_estimation = 0.0; // mb something else
-            sleepExponentially();   // inter-stream sleep
+            sleepExponentially(m_backoff);   // inter-estimate sleep
         }  while (1);
     }
     catch (...){
@@ -736,29 +1456,423 @@ void YazSender::run()
 }
 
 
-void YazSender::sendProbe(char *buffer, int paylen, int stream, int seq)
+// a few probes the receiver passes over, just ahead of a stream, so
+// that the first timed gaps don't pay for cold caches, neighbour
+// resolution or a sleeping NIC.  they always go through the udp socket,
+// whatever sends the stream, and carry no departure time.
+void YazSender::sendWarmup(int sd, char *buffer, int paylen)
+{
+    if (m_warmup <= 0)
+        return;
+
+    YazPkt *pp = (YazPkt*)buffer;
+    pp->m_stream = htonl(m_curr_stream);
+    pp->m_sequence = htonl(YAZWARMUPSEQ);
+    pp->m_session = htonl(m_session);
+    pp->m_spacing = 0;
+    pp->m_sent_hi = 0;
+    pp->m_sent_lo = 0;
+    for (int i = 0; i < m_warmup; ++i)
+    {
+        if (send(sd, (char *)pp, paylen, 0) != paylen)
+        {
+            std::cerr << "!! error sending warmup probe: " << errno << '/' << strerror(errno) << std::endl;
+            throw -1;
+        }
+    }
+    sleep_until_nsecs(now_nsecs() + YAZWARMUPLEAD * 1000LL);
+}
+
+
+// a zero cpu latency request keeps every cpu out of idle states with
+// any exit latency for as long as the descriptor stays open, so it is
+// held only while a stream is being sent.
+void YazSender::holdLatency()
+{
+    if (!m_pm_qos || m_pm_qos_fd >= 0)
+        return;
+
+    int target = 0;
+    m_pm_qos_fd = open(YAZPMQOSDEV, O_WRONLY);
+    if (m_pm_qos_fd < 0 || write(m_pm_qos_fd, &target, sizeof(target)) != sizeof(target))
+    {
+        std::cerr << "!! (non-fatal) couldn't hold cpu latency request (" << YAZPMQOSDEV << "): " << errno << '/' << strerror(errno) << " - fallback to none" << std::endl;
+        if (m_pm_qos_fd >= 0)
+            close(m_pm_qos_fd);
+        m_pm_qos_fd = -1;
+        m_pm_qos = false;
+    }
+}
+
+
+void YazSender::releaseLatency()
+{
+    if (m_pm_qos_fd < 0)
+        return;
+    close(m_pm_qos_fd);
+    m_pm_qos_fd = -1;
+}
+
+
+void YazSender::sendProbe(int sd, char *buffer, int paylen, int stream, int seq, long long sent)
 {
+#if HAVE_FRAME_TX
+    if (m_txring)
+    {
+        // the frame already has everything else in it.
+        m_txring->fill(seq, sent);
+        if (!m_txring->kick())
+            throw -1;
+        return;
+    }
+#endif
+
     YazPkt *pp = (YazPkt*)buffer;
     pp->m_stream = htonl(stream);
     pp->m_sequence = htonl(seq);
-    if (send(m_probe_sd, (char *)pp, paylen, 0) != paylen)
+    pp->m_session = htonl(m_session);
+    pp->m_spacing = htonl(m_target_spacing * 1000);
+    pp->m_sent_hi = htonl((unsigned int)(sent >> 32));
+    pp->m_sent_lo = htonl((unsigned int)(sent & 0xffffffffLL));
+    if (send(sd, (char *)pp, paylen, 0) != paylen)
     {
+        if (errno == ENOBUFS)
+        {
+            // dropped by the qdisc (we have IP_RECVERR on).
+            __sync_fetch_and_add(&m_tx_drops, 1);
+            return;
+        }
         std::cerr << "!! error sending probe: " << errno << '/' << strerror(errno) << std::endl;
         throw -1;
     }
 }
 
-// After sendStream we have m_app_probes filled
+// high-rate mode: the stream goes out as a few UDP_SEGMENT sends, each
+// of which the kernel splits into back-to-back probes.  if the target
+// spacing is not zero the socket's pacing rate is set to match it, so
+// that with the fq qdisc the sends (not the probes within one) are
+// spaced to give the target mean spacing.  there is no per-probe stamp
+// to take here, so local stamps and departure times are the schedule.
+void YazSender::sendStreamGso(int payload_size)
+{
+#if HAVE_UDP_GSO
+    unsigned int rate = ~0U;
+    if (m_target_spacing > 0)
+        rate = (unsigned int)std::min(double(~0U - 1), m_curr_pkt_size * 1000000.0 / m_target_spacing);
+    if (setsockopt(m_probe_sd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) < 0 && m_verbose > 1)
+        std::cerr << "!! (non-fatal) couldn't set pacing rate: " << errno << '/' << strerror(errno) << std::endl;
+
+    int per_send = std::max(1, std::min(YAZGSOSEGS, m_probe_buf_len / payload_size));
+    long long target_ns = m_target_spacing * 1000LL;
+    long long start = now_nsecs() + wallclock_offset();
+
+    ProbeStamp ps;
+    ps.m_stream = m_curr_stream;
+
+    int seq = 0;
+    while (seq < m_stream_length)
+    {
+        int nsegs = std::min(per_send, m_stream_length - seq);
+        for (int i = 0; i < nsegs; ++i)
+        {
+            long long sent = start + (seq + i) * target_ns;
+            YazPkt *pp = (YazPkt *)(m_probe_buf + i * payload_size);
+            pp->m_stream = htonl(m_curr_stream);
+            pp->m_sequence = htonl(seq + i);
+            pp->m_session = htonl(m_session);
+            pp->m_spacing = htonl(m_target_spacing * 1000);
+            pp->m_sent_hi = htonl((unsigned int)(sent >> 32));
+            pp->m_sent_lo = htonl((unsigned int)(sent & 0xffffffffLL));
+
+            ps.m_sequence = seq + i;
+            nsecs_to_timeval(sent, ps.m_ts);
+            m_app_probes.push_back(ps);
+        }
+
+        struct iovec iov;
+        iov.iov_base = m_probe_buf;
+        iov.iov_len = nsegs * payload_size;
+
+        union
+        {
+            char buf[CMSG_SPACE(sizeof(unsigned short))];
+            struct cmsghdr align;
+        } control;
+        memset(&control, 0, sizeof(control));
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(unsigned short));
+        *(unsigned short *)CMSG_DATA(cm) = (unsigned short)payload_size;
+
+        if (sendmsg(m_probe_sd, &msg, 0) != (ssize_t)iov.iov_len)
+        {
+            if (seq == 0 && (errno == EINVAL || errno == EIO || errno == ENOPROTOOPT))
+            {
+                // no segmentation offload after all (old kernel, or
+                // a device that can't checksum): fall back for good.
+                std::cerr << "!! (non-fatal) UDP_SEGMENT send failed: " << errno << '/' << strerror(errno) << " - leaving high-rate mode" << std::endl;
+                m_app_probes.clear();
+                m_gso = false;
+                return;
+            }
+            if (errno != ENOBUFS)
+            {
+                std::cerr << "!! error sending probe train: " << errno << '/' << strerror(errno) << std::endl;
+                throw -1;
+            }
+            __sync_fetch_and_add(&m_tx_drops, nsegs);
+        }
+        seq += nsegs;
+    }
+#endif
+}
+
+
+#if HAVE_IO_URING
+static const unsigned long long YAZRING_TIMEOUT = ~0ULL;
+
+// the stream is queued up front as pairs of an absolute timeout linked
+// to the send it releases, so the kernel does the pacing and this
+// thread only reaps completions (and queues more probes as payload
+// slots come free).  as with UDP_SEGMENT trains the departure times
+// and local stamps are the schedule: a completion doesn't say when
+// its probe left.
+void YazSender::sendStreamUring(int payload_size)
+{
+    int nslots = YAZURINGENTRIES / 2;
+    struct __kernel_timespec deadlines[YAZURINGENTRIES / 2];
+    bool busy[YAZURINGENTRIES / 2];
+    memset(busy, 0, sizeof(busy));
+
+    long long target_ns = m_target_spacing * 1000LL;
+    long long wallclock = wallclock_offset();
+
+    // start far enough out that the first deadlines don't pass while
+    // the entries for them are still being written.
+    long long start = now_nsecs() + YAZURINGLEAD * 1000LL;
+
+    ProbeStamp ps;
+    ps.m_stream = m_curr_stream;
+    ps.m_ttl = 0;
+
+    int seq = 0;
+    int inflight = 0;
+    bool cancelled = false;
+    while (seq < m_stream_length || inflight > 0)
+    {
+        while (seq < m_stream_length && !busy[seq % nslots] && !cancelled)
+        {
+            int slot = seq % nslots;
+            long long target = start + seq * target_ns;
+            long long sent = target + wallclock;
+
+            YazPkt *pp = (YazPkt *)(m_ring_buf + slot * m_probe_buf_len);
+            pp->m_stream = htonl(m_curr_stream);
+            pp->m_sequence = htonl(seq);
+            pp->m_session = htonl(m_session);
+            pp->m_spacing = htonl(m_target_spacing * 1000);
+            pp->m_sent_hi = htonl((unsigned int)(sent >> 32));
+            pp->m_sent_lo = htonl((unsigned int)(sent & 0xffffffffLL));
+
+            deadlines[slot].tv_sec = target / 1000000000LL;
+            deadlines[slot].tv_nsec = target % 1000000000LL;
+            struct io_uring_sqe *t = m_ring->sqe();
+            struct io_uring_sqe *e = m_ring->sqe();
+            assert (t && e);
+            t->opcode = IORING_OP_TIMEOUT;
+            t->fd = -1;
+            t->addr = (unsigned long long)&deadlines[slot];
+            t->len = 1;
+            t->timeout_flags = IORING_TIMEOUT_ABS | IORING_TIMEOUT_ETIME_SUCCESS;
+#if !HAVE_CLOCK_NANOSLEEP
+            t->timeout_flags |= IORING_TIMEOUT_REALTIME;
+#endif
+            t->flags = IOSQE_IO_LINK;
+            t->user_data = YAZRING_TIMEOUT;
+            e->opcode = IORING_OP_SEND;
+            e->fd = m_probe_sd;
+            e->addr = (unsigned long long)pp;
+            e->len = payload_size;
+            e->user_data = slot;
+
+            busy[slot] = true;
+            inflight++;
+            ps.m_sequence = seq++;
+            nsecs_to_timeval(sent, ps.m_ts);
+            m_app_probes.push_back(ps);
+        }
+
+        if (m_ring->submit(1, -1) < 0)
+        {
+            std::cerr << "!! io_uring submit: " << errno << '/' << strerror(errno) << std::endl;
+            throw -1;
+        }
+
+        struct io_uring_cqe cqe;
+        while (m_ring->cqe(cqe))
+        {
+            if (cqe.user_data == YAZRING_TIMEOUT)
+                continue;
+            busy[cqe.user_data] = false;
+            inflight--;
+            if (cqe.res == -ECANCELED)
+            {
+                // a kernel without IORING_TIMEOUT_ETIME_SUCCESS breaks
+                // the link when the timeout expires.
+                cancelled = true;
+            }
+            else if (cqe.res == -ENOBUFS)
+                __sync_fetch_and_add(&m_tx_drops, 1);
+            else if (cqe.res != payload_size)
+            {
+                std::cerr << "!! error sending probe: " << -cqe.res << '/' << strerror(-cqe.res) << std::endl;
+                throw -1;
+            }
+        }
+        if (cancelled && inflight == 0)
+            break;
+    }
+
+    if (cancelled)
+    {
+        std::cerr << "!! (non-fatal) io_uring timeouts break their links on this kernel - using the default I/O engine" << std::endl;
+        m_app_probes.clear();
+        delete m_ring;
+        m_ring = 0;
+    }
+}
+#endif
+
+
+// one lane's share of a stream sent by several pacing threads.  each
+// probe's deadline is taken from the shared start time rather than from
+// the previous send, and lanes don't wait on each other: neighbouring
+// probes may leave out of order, and the receiver sorts the stream by
+// sequence number before taking its spacings.
+void YazSender::sendLane(YazPacerLane *lane, long long start)
+{
+    int payload_size = m_curr_pkt_size - sizeof(struct ip) - sizeof(struct udphdr);
+    assert (payload_size <= m_probe_buf_len);
+
+    int nlanes = m_pacer->m_lanes.size();
+    long long target_ns = m_target_spacing * 1000LL;
+    long long wallclock = wallclock_offset();
+
+    ProbeStamp ps;
+    ps.m_stream = m_curr_stream;
+    ps.m_ttl = 0;
+
+    for (int seq = lane->m_index; seq < m_stream_length; seq += nlanes)
+    {
+        long long target = start + seq * target_ns;
+        long long wakeup = target - m_min_sleep * 1000LL;
+        if (wakeup > now_nsecs())
+            sleep_until_nsecs(wakeup);
+
+        long long now;
+        while (1)
+        {
+            now = now_nsecs();
+            if (m_pacer->m_abort)
+                return;
+            if (target - now < m_syscall_overhead * 500LL)
+                break;
+        }
+
+        // a lane that has fallen this far behind can't be brought back
+        // into step.  all the lanes stop, and as in sendStream() the
+        // local check has the stream sent again.
+        if (now > target + PACER_LANE_LEAD * 1000LL)
+        {
+            m_pacer->m_late = true;
+            m_pacer->m_abort = true;
+            if (m_verbose)
+                std::cout << "!! probe stream too fast to generate.  aborting" << std::endl;
+            return;
+        }
+
+        sendProbe(lane->m_sd, lane->m_buf, payload_size, m_curr_stream, seq, now + wallclock);
+
+        ps.m_sequence = seq;
+        nsecs_to_timeval(now + wallclock, ps.m_ts);
+        lane->m_stamps.push_back(ps);
+    }
+}
+
+
+#if HAVE_FRAME_TX
+// a back-to-back stream from the transmit ring: every frame is handed
+// to the kernel and then the whole stream goes with a single kick.
+// as with UDP_SEGMENT trains, the local stamps are all the same.
+void YazSender::sendStreamRing()
+{
+    long long sent = now_nsecs() + wallclock_offset();
+
+    ProbeStamp ps;
+    ps.m_stream = m_curr_stream;
+    ps.m_ttl = 0;
+    nsecs_to_timeval(sent, ps.m_ts);
+
+    for (int seq = 0; seq < m_stream_length; ++seq)
+    {
+        m_txring->fill(seq, sent);
+        ps.m_sequence = seq;
+        m_app_probes.push_back(ps);
+    }
+
+    if (!m_txring->kick())
+        throw -1;
+}
+#endif
+
+
 void YazSender::sendStream()
 {
     // m_target_spacing is intended pkt spacing, in microseconds
     // probes should be m_curr_pkt_size
     // send m_stream_length packets
 
-    struct timeval now, target, diff;
+    struct timeval diff;
     int payload_size = m_curr_pkt_size - sizeof(struct ip) - sizeof(struct udphdr);
-    char *buffer = new char[payload_size];
-    memset(buffer, 0, payload_size);
+    char *buffer = m_probe_buf;
+    assert (payload_size <= m_probe_buf_len);
+
+#if HAVE_FRAME_TX
+    if (m_txring)
+    {
+        if (!m_txring->prepStream(payload_size, m_session, m_curr_stream, m_target_spacing * 1000))
+            throw -1;
+        if (m_target_spacing == 0)
+        {
+            sendStreamRing();
+            return;
+        }
+    }
+#endif
+
+    if (m_gso && m_tx_mode == PTX_SOCKET)
+    {
+        sendStreamGso(payload_size);
+        if (m_gso)
+            return;
+    }
+
+#if HAVE_IO_URING
+    if (m_ring)
+    {
+        sendStreamUring(payload_size);
+        if (m_ring)
+            return;
+    }
+#endif
 
     int seq = 0;
     ProbeStamp ps;
@@ -766,55 +1880,87 @@ void YazSender::sendStream()
     ps.m_ttl = 0;
     ps.m_sequence = seq;
 
-    struct timeval target_tv = { 0, m_target_spacing };
-
-    gettimeofday(&now, 0);
-    timeradd(&now, &target_tv, &target);
-    sendProbe(buffer, payload_size, m_curr_stream, seq++);
-    ps.m_ts = now;
+    // trim the target by the smoothed pacing error of earlier streams.
+    // on a fixed schedule a steady lateness no longer widens the gaps,
+    // so this only takes out what drift is left.  (a stream left over
+    // from a failed -G train can ask for 0.)
+    int max_corr = std::max(1, m_target_spacing / 10);
+    int corr = std::max(-max_corr, std::min(max_corr, int(lrint(m_pacing_corr))));
+    long long target_ns = std::max(0LL, (m_target_spacing - corr) * 1000LL);
+
+    // deadlines are on the pacing clock; stamps are wall-clock so
+    // that they can be compared with the receiver's.
+    long long wallclock = wallclock_offset();
+
+    // every deadline is fixed from the first departure, so that a late
+    // probe doesn't push all of the ones after it back.
+    long long now = now_nsecs();
+    long long start = now;
+    sendProbe(m_probe_sd, buffer, payload_size, m_curr_stream, seq++, now + wallclock);
+    nsecs_to_timeval(now + wallclock, ps.m_ts);
     m_app_probes.push_back(ps);
 
     int remaining = m_stream_length;
     while (--remaining > 0)
     {
-        gettimeofday(&now, 0);
-        timersub(&target, &now, &diff);
-        int usec_remain = (diff.tv_sec * 1000000 + diff.tv_usec);
+        long long target = start + seq * target_ns;
 
         //
         // FIXME ??? mult by 2 ??? we already take mean and at 3 * stdev...
         //
         // int sleepy = usec_remain - m_min_sleep * 2;
-        int sleepy = usec_remain - m_min_sleep;
-        if (sleepy > 0)
-            usleep(sleepy);
+        long long wakeup = target - m_min_sleep * 1000LL;
+        if (wakeup > now_nsecs())
+            sleep_until_nsecs(wakeup);
 
         while (1)
         {
-            gettimeofday(&now, 0);
-            timersub(&target, &now, &diff);
-            usec_remain = (diff.tv_sec * 1000000 + diff.tv_usec);
+            now = now_nsecs();
 
             //
             // what's justification for div 2?  does this cause the
             // half micro shift above the target spacing?
             //
-            if (usec_remain < (m_syscall_overhead/2))
+            if (target - now < m_syscall_overhead * 500LL)
                 break;
         }
 
-        sendProbe(buffer, payload_size, m_curr_stream, seq);
+        // a whole gap behind the schedule, the next probe could only
+        // go back to back with this one.  the rest of the stream is
+        // not sent, and the local check has it sent again.
+        if (target_ns > 0 && now - target > target_ns)
+        {
+            m_pacer->m_late = true;
+            if (m_verbose)
+                std::cout << "!! probe stream too fast to generate.  aborting" << std::endl;
+            return;
+        }
+
+        sendProbe(m_probe_sd, buffer, payload_size, m_curr_stream, seq, now + wallclock);
 
-        timeradd(&now, &target_tv, &target);
         ps.m_sequence = seq++;
-        ps.m_ts = now;
+        nsecs_to_timeval(now + wallclock, ps.m_ts);
         m_app_probes.push_back(ps);
-        if (timercmp(&now, &target, >))
+    }
+
+    // integrate the median departure spacing error of this stream into
+    // the correction applied to the next one.  the median keeps the
+    // odd preempted gap from dragging the correction around.
+    if (m_app_probes.size() > 1)
+    {
+        std::vector<int> &gaps = m_gaps;
+        gaps.clear();
+        for (size_t i = 1; i < m_app_probes.size(); ++i)
         {
-            std::cout << "!! probe stream too fast to generate.  aborting" << std::endl;
-            break;
+            timersub(&m_app_probes[i].m_ts, &m_app_probes[i-1].m_ts, &diff);
+            gaps.push_back(diff.tv_sec * 1000000 + diff.tv_usec);
         }
+        std::nth_element(gaps.begin(), gaps.begin() + gaps.size()/2, gaps.end());
+        int gap = gaps[gaps.size()/2];
+        m_pacing_corr += YAZRECALALPHA * (gap - m_target_spacing);
+        m_pacing_corr = std::max(double(-max_corr), std::min(double(max_corr), m_pacing_corr));
+        if (m_verbose > 2)
+            std::cout << "##pacing error: " << gap - m_target_spacing << " correction: " << m_pacing_corr << std::endl;
     }
-    delete [] buffer;
 }
 
@@ -0,0 +1,400 @@
+/*
+ * Copyright (c) 2005  Joel Sommers.  All rights reserved.
+ *
+ * This file is part of yaz, an end-to-end available bandwidth
+ * measurement tool.
+ *
+ * Yaz is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Yaz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Yaz; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "yaz.h"
+
+#if HAVE_FRAME_TX
+
+#include <fstream>
+#include <sstream>
+#include <sys/ioctl.h>
+#include <ifaddrs.h>
+#include <net/route.h>
+#include <net/if_arp.h>
+
+//
+// probe transmission from prebuilt frames (a PACKET_TX_RING here, or
+// an AF_XDP umem in yaz_xdp.cc).  the sender's udp probe socket stays
+// open (it holds the source port and keeps the neighbour entry fresh)
+// but probes skip the udp/ip stack: one frame per probe is prebuilt in
+// memory shared with the kernel, and a send only has to stamp the
+// frame and kick the socket.
+//
+
+
+static bool is_local_addr(const struct in_addr &addr)
+{
+    struct ifaddrs *ifa = 0;
+    if (getifaddrs(&ifa) < 0)
+        return false;
+
+    bool local = false;
+    for (struct ifaddrs *i = ifa; i && !local; i = i->ifa_next)
+    {
+        if (i->ifa_addr && i->ifa_addr->sa_family == AF_INET &&
+            ((struct sockaddr_in *)i->ifa_addr)->sin_addr.s_addr == addr.s_addr)
+            local = true;
+    }
+    freeifaddrs(ifa);
+    return local;
+}
+
+
+// outgoing interface and next hop for dst, by longest prefix match on
+// the main routing table.  local addresses go out the loopback.
+static bool find_route(const struct in_addr &dst, std::string &dev, struct in_addr &nexthop)
+{
+    if (is_local_addr(dst) || (ntohl(dst.s_addr) >> 24) == 127)
+    {
+        dev = "lo";
+        nexthop = dst;
+        return true;
+    }
+
+    std::ifstream in("/proc/net/route");
+    std::string line;
+    std::getline(in, line);     // column headings
+
+    int best = -1;
+    while (std::getline(in, line))
+    {
+        // addresses are printed as the raw (network order) words.
+        std::istringstream fields(line);
+        std::string iface;
+        unsigned int dest, gw, flags, refcnt, use, metric, mask;
+        fields >> iface >> std::hex >> dest >> gw >> flags >> std::dec
+               >> refcnt >> use >> metric >> std::hex >> mask;
+        if (!fields || !(flags & RTF_UP) || (dst.s_addr & mask) != dest)
+            continue;
+
+        int plen = __builtin_popcount(mask);
+        if (plen <= best)
+            continue;
+        best = plen;
+        dev = iface;
+        nexthop.s_addr = (flags & RTF_GATEWAY) ? gw : dst.s_addr;
+    }
+    return (best >= 0);
+}
+
+
+static bool find_neighbour(const struct in_addr &ip, const std::string &dev, unsigned char *mac)
+{
+    std::ifstream in("/proc/net/arp");
+    std::string line;
+    std::getline(in, line);     // column headings
+
+    char want[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &ip, want, INET_ADDRSTRLEN);
+
+    while (std::getline(in, line))
+    {
+        std::istringstream fields(line);
+        std::string addr, hwtype, flags, hwaddr, mask, iface;
+        fields >> addr >> hwtype >> flags >> hwaddr >> mask >> iface;
+        if (!fields || addr != want || iface != dev)
+            continue;
+        if (!(strtoul(flags.c_str(), 0, 16) & ATF_COM))
+            continue;
+
+        unsigned int b[ETH_ALEN];
+        if (sscanf(hwaddr.c_str(), "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != ETH_ALEN)
+            continue;
+        for (int i = 0; i < ETH_ALEN; ++i)
+            mac[i] = (unsigned char)b[i];
+        return true;
+    }
+    return false;
+}
+
+
+static unsigned short ip_checksum(const unsigned short *p, int len)
+{
+    unsigned int sum = 0;
+    for (; len > 1; len -= 2)
+        sum += *p++;
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ((unsigned short)~sum);
+}
+
+
+bool YazFrameTx::findPath(int probe_sd, std::string &dev)
+{
+    socklen_t slen = sizeof(struct sockaddr_in);
+    if (getsockname(probe_sd, (struct sockaddr *)&m_src, &slen) < 0)
+    {
+        std::cerr << "!!couldn't get probe socket address: " << errno << '/' << strerror(errno) << std::endl;
+        return false;
+    }
+    slen = sizeof(struct sockaddr_in);
+    if (getpeername(probe_sd, (struct sockaddr *)&m_dst, &slen) < 0)
+    {
+        std::cerr << "!!couldn't get probe socket peer: " << errno << '/' << strerror(errno) << std::endl;
+        return false;
+    }
+
+    struct in_addr nexthop;
+    if (!find_route(m_dst.sin_addr, dev, nexthop))
+    {
+        std::cerr << "!!no route to " << inet_ntoa(m_dst.sin_addr) << " for probe frames" << std::endl;
+        return false;
+    }
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(struct ifreq));
+    strncpy(ifr.ifr_name, dev.c_str(), IFNAMSIZ-1);
+    if (ioctl(probe_sd, SIOCGIFFLAGS, &ifr) < 0)
+    {
+        std::cerr << "!!couldn't get flags of " << dev << ": " << errno << '/' << strerror(errno) << std::endl;
+        return false;
+    }
+
+    // the loopback takes frames with zero addresses.
+    if (ifr.ifr_flags & IFF_LOOPBACK)
+        return true;
+
+    if (ioctl(probe_sd, SIOCGIFHWADDR, &ifr) < 0 || ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER)
+    {
+        std::cerr << "!!probe frames need an ethernet interface (" << dev << ")" << std::endl;
+        return false;
+    }
+    memcpy(m_src_mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+    if (!find_neighbour(nexthop, dev, m_dst_mac))
+    {
+        std::cerr << "!!no resolved neighbour entry for " << inet_ntoa(nexthop) << " on " << dev << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+int YazFrameTx::buildFrame(char *data, int paylen)
+{
+    int iplen = sizeof(struct ip) + sizeof(struct udphdr) + paylen;
+    memset(data, 0, ETH_HLEN + iplen);
+
+    struct ether_header *eh = (struct ether_header *)data;
+    memcpy(eh->ether_dhost, m_dst_mac, ETH_ALEN);
+    memcpy(eh->ether_shost, m_src_mac, ETH_ALEN);
+    eh->ether_type = htons(ETHERTYPE_IP);
+
+    struct ip *iph = (struct ip *)(data + ETH_HLEN);
+    iph->ip_v = 4;
+    iph->ip_hl = sizeof(struct ip) >> 2;
+    iph->ip_len = htons(iplen);
+    iph->ip_off = htons(IP_DF);
+    iph->ip_ttl = 64;
+    iph->ip_p = IPPROTO_UDP;
+    iph->ip_src = m_src.sin_addr;
+    iph->ip_dst = m_dst.sin_addr;
+    iph->ip_sum = ip_checksum((const unsigned short *)iph, sizeof(struct ip));
+
+    // no udp checksum, so the payload can change underneath the
+    // headers.
+    struct udphdr *uh = (struct udphdr *)(iph + 1);
+    uh->uh_sport = m_src.sin_port;
+    uh->uh_dport = m_dst.sin_port;
+    uh->uh_ulen = htons(sizeof(struct udphdr) + paylen);
+    uh->uh_sum = 0;
+
+    return (ETH_HLEN + iplen);
+}
+
+
+void YazFrameTx::stampFrame(char *data, unsigned int session, int stream, int spacing_ns)
+{
+    YazPkt *pp = (YazPkt *)(data + ETH_HLEN + sizeof(struct ip) + sizeof(struct udphdr));
+    pp->m_stream = htonl(stream);
+    pp->m_session = htonl(session);
+    pp->m_spacing = htonl(spacing_ns);
+}
+
+
+void YazFrameTx::seqFrame(char *data, int seq, long long sent)
+{
+    YazPkt *pp = (YazPkt *)(data + ETH_HLEN + sizeof(struct ip) + sizeof(struct udphdr));
+    pp->m_sequence = htonl(seq);
+    pp->m_sent_hi = htonl((unsigned int)(sent >> 32));
+    pp->m_sent_lo = htonl((unsigned int)(sent & 0xffffffffLL));
+}
+
+#endif // HAVE_FRAME_TX
+
+
+#if HAVE_PACKET_TX_RING
+
+static inline volatile unsigned int &frame_status(struct tpacket2_hdr *hdr)
+{
+    return *(volatile unsigned int *)&hdr->tp_status;
+}
+
+
+bool YazTxRing::open(int probe_sd, int nframes, int maxlen, bool bypass, int verbose)
+{
+    std::string dev;
+    if (!findPath(probe_sd, dev))
+        return false;
+
+    m_sd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (m_sd < 0)
+    {
+        std::cerr << "!!couldn't open packet socket (needs CAP_NET_RAW): " << errno << '/' << strerror(errno) << std::endl;
+        return false;
+    }
+
+    int ver = TPACKET_V2;
+    if (setsockopt(m_sd, SOL_PACKET, PACKET_VERSION, &ver, sizeof(int)) < 0)
+    {
+        std::cerr << "!!couldn't set packet socket version: " << errno << '/' << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+
+    if (bypass)
+    {
+        int one = 1;
+        if (setsockopt(m_sd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(int)) < 0)
+            std::cerr << "!! (non-fatal) couldn't bypass qdisc: " << errno << '/' << strerror(errno) << std::endl;
+    }
+
+    // one frame per probe of a stream, each big enough for the
+    // largest probe.
+    int need = TPACKET_ALIGN(sizeof(struct tpacket2_hdr)) + ETH_HLEN + maxlen;
+    m_frame_size = TPACKET_ALIGNMENT;
+    while (m_frame_size < need)
+        m_frame_size <<= 1;
+
+    struct tpacket_req req;
+    memset(&req, 0, sizeof(struct tpacket_req));
+    req.tp_frame_size = m_frame_size;
+    req.tp_block_size = std::max(getpagesize(), m_frame_size);
+    req.tp_block_nr = (nframes * m_frame_size + req.tp_block_size - 1) / req.tp_block_size;
+    req.tp_frame_nr = req.tp_block_nr * (req.tp_block_size / m_frame_size);
+    if (setsockopt(m_sd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(struct tpacket_req)) < 0)
+    {
+        std::cerr << "!!couldn't set up PACKET_TX_RING: " << errno << '/' << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+    m_nframes = req.tp_frame_nr;
+    m_ring_len = (size_t)req.tp_block_nr * req.tp_block_size;
+
+    void *ring = mmap(0, m_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED, m_sd, 0);
+    if (ring == MAP_FAILED)
+    {
+        std::cerr << "!!couldn't map transmit ring: " << errno << '/' << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+    m_ring = (char *)ring;
+    memset(m_ring, 0, m_ring_len);
+
+    // protocol 0: nothing is received on this socket.
+    struct sockaddr_ll sll;
+    memset(&sll, 0, sizeof(struct sockaddr_ll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_ifindex = if_nametoindex(dev.c_str());
+    if (bind(m_sd, (const struct sockaddr *)&sll, sizeof(struct sockaddr_ll)) < 0)
+    {
+        std::cerr << "!!couldn't bind packet socket to " << dev << ": " << errno << '/' << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+
+    if (verbose)
+        std::cout << "##transmit ring on " << dev << ": " << m_nframes << " frames of " << m_frame_size << " bytes" << (bypass ? ", bypassing qdisc" : "") << std::endl;
+
+    m_paylen = -1;
+    return true;
+}
+
+
+void YazTxRing::close()
+{
+    if (m_ring)
+        munmap(m_ring, m_ring_len);
+    m_ring = 0;
+    if (m_sd >= 0)
+        ::close(m_sd);
+    m_sd = -1;
+}
+
+
+bool YazTxRing::prepStream(int paylen, unsigned int session, int stream, int spacing_ns)
+{
+    // the previous stream's frames have to be back before they can be
+    // rewritten.
+    struct timeval start, now, diff;
+    gettimeofday(&start, 0);
+    for (int i = 0; i < m_nframes; ++i)
+    {
+        while (frame_status(frame(i)) & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))
+        {
+            gettimeofday(&now, 0);
+            timersub(&now, &start, &diff);
+            if (diff.tv_sec * 1000 + diff.tv_usec / 1000 > YAZTXRINGWAIT)
+            {
+                std::cerr << "!!transmit ring didn't drain after " << YAZTXRINGWAIT << " milliseconds" << std::endl;
+                return false;
+            }
+            poll(0, 0, 1);
+        }
+        if (frame_status(frame(i)) & TP_STATUS_WRONG_FORMAT)
+        {
+            std::cerr << "!!kernel rejected a probe frame" << std::endl;
+            return false;
+        }
+    }
+
+    for (int i = 0; i < m_nframes; ++i)
+    {
+        if (paylen != m_paylen)
+            frame(i)->tp_len = buildFrame(frameData(i), paylen);
+        stampFrame(frameData(i), session, stream, spacing_ns);
+        frame_status(frame(i)) = TP_STATUS_AVAILABLE;
+    }
+    m_paylen = paylen;
+    return true;
+}
+
+
+void YazTxRing::fill(int seq, long long sent)
+{
+    int i = seq % m_nframes;
+    seqFrame(frameData(i), seq, sent);
+    __sync_synchronize();
+    frame_status(frame(i)) = TP_STATUS_SEND_REQUEST;
+}
+
+
+bool YazTxRing::kick()
+{
+    if (sendto(m_sd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 && errno != EAGAIN)
+    {
+        std::cerr << "!! error sending probe: " << errno << '/' << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+#endif // HAVE_PACKET_TX_RING
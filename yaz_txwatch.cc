@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2005  Joel Sommers.  All rights reserved.
+ *
+ * This file is part of yaz, an end-to-end available bandwidth
+ * measurement tool.
+ *
+ * Yaz is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Yaz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Yaz; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include "yaz.h"
+#include <sys/ioctl.h>
+
+//
+// watching probe sends from below the socket.  software transmit
+// timestamps are taken as the driver is handed each probe, so unlike
+// our own stamps (or the schedule, with UDP_SEGMENT and io_uring) they
+// show a stream that sat in the socket or qdisc and left bunched up.
+//
+
+bool YazTxWatch::open(int sd, int verbose)
+{
+    m_sd = sd;
+    m_stamping = false;
+
+    int on = 1;
+    if (setsockopt(sd, IPPROTO_IP, IP_RECVERR, &on, sizeof(on)) < 0)
+        std::cerr << "!! (non-fatal) couldn't set IP_RECVERR on probe socket: " << errno << '/' << strerror(errno) << std::endl;
+
+#if HAVE_TX_TIMESTAMPING
+    int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_TSONLY;
+    if (setsockopt(sd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0)
+        m_stamping = true;
+    else
+        std::cerr << "!! (non-fatal) no transmit timestamps: " << errno << '/' << strerror(errno) << " - checking local spacing from queue depth only" << std::endl;
+#endif
+
+    if (m_stamping && verbose > 1)
+        std::cout << "##transmit timestamps on probe socket " << sd << std::endl;
+    return (m_stamping);
+}
+
+
+// bytes sent on the socket that the device hasn't finished with.
+int YazTxWatch::outq()
+{
+#if HAVE_SIOCOUTQ
+    int queued = 0;
+    if (m_sd >= 0 && ioctl(m_sd, SIOCOUTQ, &queued) == 0)
+        return (queued);
+#endif
+    return (0);
+}
+
+
+// one message off the error queue: 1 for a transmit timestamp (in ns),
+// 0 for anything else (an icmp error, say), -1 once it is empty.
+int YazTxWatch::next(long long &ns)
+{
+#if HAVE_TX_TIMESTAMPING
+    char data[64];
+    union
+    {
+        char buf[512];
+        struct cmsghdr align;
+    } control;
+
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = sizeof(data);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if (recvmsg(m_sd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        return (-1);
+
+    bool sched = false;
+    bool stamped = false;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+    {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING)
+        {
+            const struct scm_timestamping *ts = (const struct scm_timestamping *)CMSG_DATA(cm);
+            ns = ts->ts[0].tv_sec * 1000000000LL + ts->ts[0].tv_nsec;
+            stamped = true;
+        }
+        else if (cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_RECVERR)
+        {
+            const struct sock_extended_err *ee = (const struct sock_extended_err *)CMSG_DATA(cm);
+            sched = (ee->ee_origin == SO_EE_ORIGIN_TIMESTAMPING && ee->ee_info == SCM_TSTAMP_SND);
+        }
+    }
+    return ((stamped && sched) ? 1 : 0);
+#else
+    return (-1);
+#endif
+}
+
+
+// empty the error queue, before a stream.
+void YazTxWatch::discard()
+{
+    long long ns;
+    while (m_sd >= 0 && next(ns) >= 0)
+        ;
+}
+
+
+// the transmit times of the last n sends, oldest first, waiting up to
+// wait msecs for them to come in.  anything older still queued belongs
+// to an earlier send and is pushed out.  returns how many there are.
+int YazTxWatch::collect(long long *tx, int n, int wait)
+{
+    int got = 0;
+    long long deadline = now_nsecs() + wait * 1000000LL;
+    while (m_stamping && n > 0)
+    {
+        long long ns;
+        int rv = next(ns);
+        if (rv > 0)
+        {
+            if (got == n)
+            {
+                memmove(tx, tx + 1, (n - 1) * sizeof(long long));
+                got--;
+            }
+            tx[got++] = ns;
+            continue;
+        }
+        if (rv == 0)
+            continue;
+
+        long long left = deadline - now_nsecs();
+        if (got == n || left <= 0)
+            break;
+        struct pollfd pfd;
+        pfd.fd = m_sd;
+        pfd.events = 0;         // errors are always reported
+        pfd.revents = 0;
+        poll(&pfd, 1, std::max(1, int(left / 1000000)));
+    }
+    return (got);
+}
@@ -0,0 +1,450 @@
+/*
+ * Copyright (c) 2005  Joel Sommers.  All rights reserved.
+ *
+ * This file is part of yaz, an end-to-end available bandwidth
+ * measurement tool.
+ *
+ * Yaz is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Yaz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Yaz; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "yaz.h"
+
+#if HAVE_IO_URING
+
+#include <signal.h>
+#include <algorithm>
+#include <sys/syscall.h>
+
+//
+// io_uring set up and driven through the system calls directly, as
+// liburing is not something we want to depend on.  needs a kernel with
+// IORING_FEAT_EXT_ARG (5.11) for waits with a timeout; provided buffer
+// rings and multishot receives are newer still (6.0).
+//
+
+static int sys_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return (syscall(__NR_io_uring_setup, entries, p));
+}
+
+
+static int sys_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                           unsigned int flags, void *arg, size_t argsz)
+{
+    return (syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz));
+}
+
+
+static int sys_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    return (syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+
+YazUring::YazUring() :
+    m_fd(-1), m_sq_map(0), m_sq_map_len(0), m_cq_map(0), m_cq_map_len(0),
+    m_sqes(0), m_sqes_len(0), m_sq_head(0), m_sq_tail(0), m_sq_array(0),
+    m_sq_mask(0), m_sq_entries(0), m_sq_local(0), m_to_submit(0),
+    m_cq_head(0), m_cq_tail(0), m_cqes(0), m_cq_mask(0),
+    m_br(0), m_br_len(0), m_group(0), m_bufs(0), m_nbufs(0), m_buflen(0), m_br_tail(0)
+{
+}
+
+
+bool YazUring::open(int entries, int verbose)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(struct io_uring_params));
+    m_fd = sys_uring_setup(entries, &p);
+    if (m_fd < 0)
+    {
+        std::cerr << "!!couldn't set up io_uring: " << errno << '/' << strerror(errno) << std::endl;
+        return false;
+    }
+    if (!(p.features & IORING_FEAT_EXT_ARG))
+    {
+        std::cerr << "!!io_uring without timed waits (IORING_FEAT_EXT_ARG)" << std::endl;
+        close();
+        return false;
+    }
+
+    m_sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    m_cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        m_sq_map_len = m_cq_map_len = std::max(m_sq_map_len, m_cq_map_len);
+
+    m_sq_map = mmap(0, m_sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (m_sq_map == MAP_FAILED)
+    {
+        m_sq_map = 0;
+        std::cerr << "!!couldn't map io_uring submission ring: " << errno << '/' << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        m_cq_map = m_sq_map;
+    else
+    {
+        m_cq_map = mmap(0, m_cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        if (m_cq_map == MAP_FAILED)
+        {
+            m_cq_map = 0;
+            std::cerr << "!!couldn't map io_uring completion ring: " << errno << '/' << strerror(errno) << std::endl;
+            close();
+            return false;
+        }
+    }
+
+    m_sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = (struct io_uring_sqe *)mmap(0, m_sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED)
+    {
+        m_sqes = 0;
+        std::cerr << "!!couldn't map io_uring submission entries: " << errno << '/' << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+
+    char *sq = (char *)m_sq_map;
+    char *cq = (char *)m_cq_map;
+    m_sq_head = (volatile unsigned int *)(sq + p.sq_off.head);
+    m_sq_tail = (volatile unsigned int *)(sq + p.sq_off.tail);
+    m_sq_array = (unsigned int *)(sq + p.sq_off.array);
+    m_sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+    m_sq_entries = p.sq_entries;
+    m_sq_local = *m_sq_tail;
+    m_cq_head = (volatile unsigned int *)(cq + p.cq_off.head);
+    m_cq_tail = (volatile unsigned int *)(cq + p.cq_off.tail);
+    m_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    m_cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+
+    // entries map one to one onto the array, so it is filled once.
+    for (unsigned int i = 0; i < m_sq_entries; ++i)
+        m_sq_array[i] = i;
+
+    if (verbose > 1)
+        std::cout << "##io_uring with " << p.sq_entries << " entries" << std::endl;
+    return true;
+}
+
+
+void YazUring::close()
+{
+    if (m_br)
+    {
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(struct io_uring_buf_reg));
+        reg.bgid = m_group;
+        sys_uring_register(m_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(m_br, m_br_len);
+        m_br = 0;
+    }
+    delete [] m_bufs;
+    m_bufs = 0;
+    if (m_sqes)
+        munmap(m_sqes, m_sqes_len);
+    if (m_cq_map && m_cq_map != m_sq_map)
+        munmap(m_cq_map, m_cq_map_len);
+    if (m_sq_map)
+        munmap(m_sq_map, m_sq_map_len);
+    m_sqes = 0;
+    m_sq_map = m_cq_map = 0;
+    if (m_fd >= 0)
+        ::close(m_fd);
+    m_fd = -1;
+}
+
+
+// the next free submission entry, cleared, or 0 if the ring is full of
+// entries the kernel hasn't picked up yet.
+struct io_uring_sqe *YazUring::sqe()
+{
+    if (m_sq_local - *m_sq_head >= m_sq_entries)
+        return (0);
+
+    struct io_uring_sqe *e = &m_sqes[m_sq_local & m_sq_mask];
+    memset(e, 0, sizeof(struct io_uring_sqe));
+    m_sq_local++;
+    m_to_submit++;
+    return (e);
+}
+
+
+// submit whatever has been queued and, if wait_nr > 0, wait up to
+// timeout msecs (forever if negative) for that many completions.
+// returns the number submitted, 0 on a timeout, or -1.
+int YazUring::submit(int wait_nr, int timeout)
+{
+    __sync_synchronize();
+    *m_sq_tail = m_sq_local;
+
+    unsigned int flags = 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    void *argp = 0;
+    size_t argsz = 0;
+    if (wait_nr > 0)
+    {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout >= 0)
+        {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000LL;
+            memset(&arg, 0, sizeof(struct io_uring_getevents_arg));
+            arg.sigmask_sz = _NSIG / 8;
+            arg.ts = (unsigned long long)&ts;
+            argp = &arg;
+            argsz = sizeof(struct io_uring_getevents_arg);
+            flags |= IORING_ENTER_EXT_ARG;
+        }
+    }
+    else if (m_to_submit == 0)
+        return (0);
+
+    int n = sys_uring_enter(m_fd, m_to_submit, wait_nr, flags, argp, argsz);
+    if (n < 0)
+        return ((errno == ETIME || errno == EINTR) ? 0 : -1);
+    m_to_submit -= n;
+    return (n);
+}
+
+
+bool YazUring::cqe(struct io_uring_cqe &out)
+{
+    unsigned int head = *m_cq_head;
+    if (head == *m_cq_tail)
+        return false;
+    __sync_synchronize();
+    out = m_cqes[head & m_cq_mask];
+    __sync_synchronize();
+    *m_cq_head = head + 1;
+    return true;
+}
+
+
+// register nbufs (a power of two) buffers of buflen bytes as group
+// for receives with IOSQE_BUFFER_SELECT to choose from.
+bool YazUring::provide(int group, int nbufs, int buflen)
+{
+    m_br_len = nbufs * sizeof(struct io_uring_buf);
+    void *br = mmap(0, m_br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (br == MAP_FAILED)
+    {
+        std::cerr << "!!couldn't allocate io_uring buffer ring: " << errno << '/' << strerror(errno) << std::endl;
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(struct io_uring_buf_reg));
+    reg.ring_addr = (unsigned long long)br;
+    reg.ring_entries = nbufs;
+    reg.bgid = group;
+    if (sys_uring_register(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        std::cerr << "!!couldn't register io_uring buffer ring: " << errno << '/' << strerror(errno) << std::endl;
+        munmap(br, m_br_len);
+        return false;
+    }
+
+    m_br = (struct io_uring_buf_ring *)br;
+    m_group = group;
+    m_nbufs = nbufs;
+    m_buflen = buflen;
+    m_bufs = new char[(size_t)nbufs * buflen];
+    memset(m_bufs, 0, (size_t)nbufs * buflen);
+    m_br_tail = 0;
+    for (int i = 0; i < nbufs; ++i)
+        recycle(i);
+    return true;
+}
+
+
+void YazUring::recycle(int bid)
+{
+    // not m_br->bufs: in c++ the kernel header's flexible array member
+    // lands after a 1-byte placeholder, 8 bytes into the ring.
+    struct io_uring_buf *b = (struct io_uring_buf *)m_br + (m_br_tail & (m_nbufs - 1));
+    b->addr = (unsigned long long)buffer(bid);
+    b->len = m_buflen;
+    b->bid = bid;
+    m_br_tail++;
+    __sync_synchronize();
+    m_br->tail = m_br_tail;
+}
+
+
+//
+// YazPoller on the ring.  polls are one-shot and re-armed on the wait
+// after they fire, by which time the caller has read what was there,
+// so that (as with epoll and poll()) a descriptor that is still
+// readable is reported again.
+//
+
+static const unsigned int YAZRING_POLL = 1;
+static const unsigned int YAZRING_RECV = 2;
+static const unsigned int YAZRING_REMOVE = 3;
+
+static unsigned long long ring_tag(unsigned int what, int fd)
+{
+    return (((unsigned long long)what << 32) | (unsigned int)fd);
+}
+
+
+// a submission entry, making room by submitting if the ring is full.
+struct io_uring_sqe *YazPoller::ringSqe()
+{
+    struct io_uring_sqe *e = m_ring->sqe();
+    if (!e)
+    {
+        m_ring->submit(0, 0);
+        e = m_ring->sqe();
+    }
+    if (!e)
+    {
+        std::cerr << "!!io_uring submission queue full" << std::endl;
+        throw -1;
+    }
+    return (e);
+}
+
+
+void YazPoller::armPoll(int fd)
+{
+    struct io_uring_sqe *e = ringSqe();
+    e->opcode = IORING_OP_POLL_ADD;
+    e->fd = fd;
+    e->poll32_events = POLLIN;
+    e->user_data = ring_tag(YAZRING_POLL, fd);
+}
+
+
+void YazPoller::disarm(int fd)
+{
+    std::vector<int>::iterator it = std::find(m_rearm.begin(), m_rearm.end(), fd);
+    if (it != m_rearm.end())
+    {
+        // fired last time and not polled since.
+        m_rearm.erase(it);
+        return;
+    }
+
+    struct io_uring_sqe *e = ringSqe();
+    e->opcode = IORING_OP_POLL_REMOVE;
+    e->fd = -1;
+    e->addr = ring_tag(YAZRING_POLL, fd);
+    e->user_data = ring_tag(YAZRING_REMOVE, fd);
+    m_ring->submit(0, 0);
+}
+
+
+// a multishot recvmsg on fd: each datagram lands in a buffer of its
+// own, laid out as a struct io_uring_recvmsg_out, the control messages
+// and up to paylen bytes of payload.
+bool YazPoller::addRecv(int fd, int paylen, int nbufs)
+{
+    memset(&m_recv_msg, 0, sizeof(struct msghdr));
+    m_recv_msg.msg_controllen = CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(int));
+    int hdrlen = sizeof(struct io_uring_recvmsg_out) + m_recv_msg.msg_controllen;
+    if (!m_ring || !m_ring->provide(0, nbufs, hdrlen + paylen))
+        return false;
+
+    m_recv_fd = fd;
+    m_recvd.reserve(nbufs);
+    armRecv();
+    return true;
+}
+
+
+void YazPoller::armRecv()
+{
+    struct io_uring_sqe *e = ringSqe();
+    e->opcode = IORING_OP_RECVMSG;
+    e->fd = m_recv_fd;
+    e->addr = (unsigned long long)&m_recv_msg;
+    e->len = 1;
+    e->ioprio = IORING_RECV_MULTISHOT;
+    e->flags = IOSQE_BUFFER_SELECT;
+    e->buf_group = 0;
+    e->user_data = ring_tag(YAZRING_RECV, m_recv_fd);
+    m_recv_armed = true;
+}
+
+
+// hand the buffers of the datagrams returned by the last wait back to
+// the kernel, and restart the receive if it stopped for want of them.
+void YazPoller::releaseReceived()
+{
+    for (size_t i = 0; i < m_recvd.size(); ++i)
+        m_ring->recycle(m_recvd[i].m_bid);
+    m_recvd.clear();
+    if (m_recv_fd >= 0 && !m_recv_armed)
+        armRecv();
+}
+
+
+int YazPoller::waitRing(std::vector<int> &ready, int timeout)
+{
+    for (size_t i = 0; i < m_rearm.size(); ++i)
+        armPoll(m_rearm[i]);
+    m_rearm.clear();
+
+    if (m_ring->submit(timeout == 0 ? 0 : 1, timeout) < 0)
+        return (-1);
+
+    int hdrlen = sizeof(struct io_uring_recvmsg_out) + m_recv_msg.msg_namelen + m_recv_msg.msg_controllen;
+    bool received = false;
+    struct io_uring_cqe cqe;
+    while (m_ring->cqe(cqe))
+    {
+        unsigned int what = (unsigned int)(cqe.user_data >> 32);
+        int fd = (int)(cqe.user_data & 0xffffffffULL);
+        if (what == YAZRING_POLL && cqe.res > 0)
+        {
+            ready.push_back(fd);
+            m_rearm.push_back(fd);
+        }
+        else if (what == YAZRING_RECV)
+        {
+            if (!(cqe.flags & IORING_CQE_F_MORE))
+                m_recv_armed = false;
+            if (cqe.res < 0 || !(cqe.flags & IORING_CQE_F_BUFFER))
+            {
+                // out of buffers: restarted once they come back.
+                if (cqe.res != -ENOBUFS)
+                    std::cerr << "!!io_uring probe receive: " << -cqe.res << '/' << strerror(-cqe.res) << std::endl;
+                continue;
+            }
+
+            YazRingMsg msg;
+            msg.m_bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            char *buf = m_ring->buffer(msg.m_bid);
+            struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+            msg.m_control = buf + sizeof(struct io_uring_recvmsg_out) + m_recv_msg.msg_namelen;
+            msg.m_control_len = std::min(out->controllen, (unsigned int)m_recv_msg.msg_controllen);
+            msg.m_payload = buf + hdrlen;
+            msg.m_len = std::min(int(out->payloadlen), m_ring->bufferLen() - hdrlen);
+            m_recvd.push_back(msg);
+            received = true;
+        }
+    }
+
+    if (received)
+        ready.push_back(m_recv_fd);
+    else if (m_recv_fd >= 0 && !m_recv_armed && m_recvd.empty())
+        armRecv();
+    return (ready.size());
+}
+
+#endif // HAVE_IO_URING
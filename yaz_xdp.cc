@@ -0,0 +1,705 @@
+/*
+ * Copyright (c) 2005  Joel Sommers.  All rights reserved.
+ *
+ * This file is part of yaz, an end-to-end available bandwidth
+ * measurement tool.
+ *
+ * Yaz is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Yaz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Yaz; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "yaz.h"
+
+#if HAVE_AF_XDP
+
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+
+//
+// AF_XDP probe send and receive.  this talks to the kernel directly
+// (bpf(2), the xdp socket options and mmaped rings) rather than going
+// through libbpf or libxdp.  the same code works in native (driver)
+// mode, with zero copy where the driver has it, and in generic (skb)
+// mode on any interface, veth included.
+//
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+static const long long YAZXDPSTAMPSLOP = 1000000000LL;     // nsecs
+static const int YAZBPFLOGLEN = 1 << 16;                   // verifier log bytes
+
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return (syscall(__NR_bpf, cmd, attr, sizeof(union bpf_attr)));
+}
+
+
+static struct bpf_insn insn(unsigned char code, int dst, int src, short off, int imm)
+{
+    struct bpf_insn in;
+    memset(&in, 0, sizeof(struct bpf_insn));
+    in.code = code;
+    in.dst_reg = dst;
+    in.src_reg = src;
+    in.off = off;
+    in.imm = imm;
+    return in;
+}
+
+
+enum { R0, R1, R2, R3, R4, R5, R6, R7, R8, R9 };
+
+
+// match ethernet/ipv4 (no options, not a fragment)/udp to port, with
+// at least need bytes of packet from data to end.  branches that don't
+// match are left in to_pass for the caller to patch.  uses r4 and r5.
+static void match_probe(std::vector<struct bpf_insn> &prog, int data, int end,
+                        unsigned short port, int need, std::vector<size_t> &to_pass)
+{
+    prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, R4, data, 0, 0));
+    prog.push_back(insn(BPF_ALU64 | BPF_ADD | BPF_K, R4, 0, 0, need));
+    to_pass.push_back(prog.size());
+    prog.push_back(insn(BPF_JMP | BPF_JGT | BPF_X, R4, end, 0, 0));
+    prog.push_back(insn(BPF_LDX | BPF_MEM | BPF_H, R5, data, offsetof(struct ether_header, ether_type), 0));
+    to_pass.push_back(prog.size());
+    prog.push_back(insn(BPF_JMP | BPF_JNE | BPF_K, R5, 0, 0, htons(ETHERTYPE_IP)));
+    prog.push_back(insn(BPF_LDX | BPF_MEM | BPF_B, R5, data, ETH_HLEN, 0));
+    prog.push_back(insn(BPF_ALU64 | BPF_AND | BPF_K, R5, 0, 0, 0x0f));
+    to_pass.push_back(prog.size());
+    prog.push_back(insn(BPF_JMP | BPF_JNE | BPF_K, R5, 0, 0, sizeof(struct ip) >> 2));
+    prog.push_back(insn(BPF_LDX | BPF_MEM | BPF_H, R5, data, ETH_HLEN + offsetof(struct ip, ip_off), 0));
+    prog.push_back(insn(BPF_ALU64 | BPF_AND | BPF_K, R5, 0, 0, htons(IP_MF | IP_OFFMASK)));
+    to_pass.push_back(prog.size());
+    prog.push_back(insn(BPF_JMP | BPF_JNE | BPF_K, R5, 0, 0, 0));
+    prog.push_back(insn(BPF_LDX | BPF_MEM | BPF_B, R5, data, ETH_HLEN + offsetof(struct ip, ip_p), 0));
+    to_pass.push_back(prog.size());
+    prog.push_back(insn(BPF_JMP | BPF_JNE | BPF_K, R5, 0, 0, IPPROTO_UDP));
+    prog.push_back(insn(BPF_LDX | BPF_MEM | BPF_H, R5, data, ETH_HLEN + sizeof(struct ip) + offsetof(struct udphdr, uh_dport), 0));
+    to_pass.push_back(prog.size());
+    prog.push_back(insn(BPF_JMP | BPF_JNE | BPF_K, R5, 0, 0, htons(port)));
+}
+
+
+static int load_xdp(const std::vector<struct bpf_insn> &prog, const char *what, int verbose)
+{
+    std::vector<char> log(YAZBPFLOGLEN, 0);
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(union bpf_attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (unsigned long long)&prog[0];
+    attr.insn_cnt = prog.size();
+    attr.license = (unsigned long long)"GPL";
+    if (verbose > 2)
+    {
+        // the kernel refuses a log buffer at log level 0.
+        attr.log_buf = (unsigned long long)&log[0];
+        attr.log_size = YAZBPFLOGLEN;
+        attr.log_level = 1;
+    }
+    int fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0)
+    {
+        std::cerr << "!!couldn't load xdp " << what << " program: " << errno << '/' << strerror(errno) << std::endl;
+        if (verbose > 2)
+            std::cerr << &log[0] << std::endl;
+    }
+    return fd;
+}
+
+
+// native mode where the driver has it, generic (skb) mode elsewhere.
+// the link goes away with its descriptor, so a receiver that dies
+// doesn't leave the program behind.
+static int link_xdp(int prog_fd, int ifindex, const char *what, int verbose)
+{
+    unsigned int modes[] = { XDP_FLAGS_DRV_MODE, XDP_FLAGS_SKB_MODE };
+    int fd = -1;
+    for (int i = 0; i < 2 && fd < 0; ++i)
+    {
+        union bpf_attr attr;
+        memset(&attr, 0, sizeof(union bpf_attr));
+        attr.link_create.prog_fd = prog_fd;
+        attr.link_create.target_ifindex = ifindex;
+        attr.link_create.attach_type = BPF_XDP;
+        attr.link_create.flags = modes[i];
+        fd = sys_bpf(BPF_LINK_CREATE, &attr);
+        if (fd >= 0 && verbose)
+            std::cout << "##xdp " << what << " attached in " << (i == 0 ? "native" : "generic") << " mode" << std::endl;
+    }
+    if (fd < 0)
+        std::cerr << "!!couldn't attach xdp " << what << " program: " << errno << '/' << strerror(errno) << std::endl;
+    return fd;
+}
+
+
+int xdp_rx_queues(const std::string &dev)
+{
+    int sd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sd < 0)
+        return 1;
+
+    struct ethtool_channels ch;
+    memset(&ch, 0, sizeof(struct ethtool_channels));
+    ch.cmd = ETHTOOL_GCHANNELS;
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(struct ifreq));
+    strncpy(ifr.ifr_name, dev.c_str(), IFNAMSIZ-1);
+    ifr.ifr_data = (char *)&ch;
+
+    int n = 1;
+    if (ioctl(sd, SIOCETHTOOL, &ifr) == 0)
+        n = std::max(1, int(ch.combined_count + ch.rx_count));
+    close(sd);
+    return n;
+}
+
+
+bool YazXsk::mapRing(YazXskRing &r, const struct xdp_ring_offset &off, off_t pgoff, size_t descsz)
+{
+    r.m_map_len = off.desc + YAZXSKRING * descsz;
+    r.m_map = mmap(0, r.m_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_sd, pgoff);
+    if (r.m_map == MAP_FAILED)
+    {
+        r.m_map = 0;
+        std::cerr << "!!couldn't map AF_XDP ring: " << errno << '/' << strerror(errno) << std::endl;
+        return false;
+    }
+    r.m_producer = (volatile unsigned int *)((char *)r.m_map + off.producer);
+    r.m_consumer = (volatile unsigned int *)((char *)r.m_map + off.consumer);
+    r.m_flags = (volatile unsigned int *)((char *)r.m_map + off.flags);
+    r.m_desc = (char *)r.m_map + off.desc;
+    return true;
+}
+
+
+void YazXsk::unmapRing(YazXskRing &r)
+{
+    if (r.m_map)
+        munmap(r.m_map, r.m_map_len);
+    r = YazXskRing();
+}
+
+
+bool YazXsk::open(int ifindex, int queue, bool rx, bool tx, int verbose)
+{
+    m_sd = socket(AF_XDP, SOCK_RAW, 0);
+    if (m_sd < 0)
+    {
+        std::cerr << "!!couldn't open AF_XDP socket: " << errno << '/' << strerror(errno) << std::endl;
+        return false;
+    }
+
+    m_umem_len = 2 * YAZXSKRING * YAZXSKFRAMESIZE;
+    void *umem = mmap(0, m_umem_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (umem == MAP_FAILED)
+    {
+        std::cerr << "!!couldn't allocate AF_XDP umem: " << errno << '/' << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+    m_umem = (char *)umem;
+
+    struct xdp_umem_reg mr;
+    memset(&mr, 0, sizeof(struct xdp_umem_reg));
+    mr.addr = (unsigned long long)m_umem;
+    mr.len = m_umem_len;
+    mr.chunk_size = YAZXSKFRAMESIZE;
+    if (setsockopt(m_sd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(struct xdp_umem_reg)) < 0)
+    {
+        std::cerr << "!!couldn't register AF_XDP umem: " << errno << '/' << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+
+    // the umem needs a fill and a completion ring even if it only
+    // sends or only receives.
+    int n = YAZXSKRING;
+    if (setsockopt(m_sd, SOL_XDP, XDP_UMEM_FILL_RING, &n, sizeof(int)) < 0 ||
+        setsockopt(m_sd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &n, sizeof(int)) < 0 ||
+        (rx && setsockopt(m_sd, SOL_XDP, XDP_RX_RING, &n, sizeof(int)) < 0) ||
+        (tx && setsockopt(m_sd, SOL_XDP, XDP_TX_RING, &n, sizeof(int)) < 0))
+    {
+        std::cerr << "!!couldn't size AF_XDP rings: " << errno << '/' << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+
+    struct xdp_mmap_offsets off;
+    socklen_t offlen = sizeof(struct xdp_mmap_offsets);
+    if (getsockopt(m_sd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &offlen) < 0)
+    {
+        std::cerr << "!!couldn't get AF_XDP ring offsets: " << errno << '/' << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+
+    if (!mapRing(m_fill, off.fr, XDP_UMEM_PGOFF_FILL_RING, sizeof(unsigned long long)) ||
+        !mapRing(m_comp, off.cr, XDP_UMEM_PGOFF_COMPLETION_RING, sizeof(unsigned long long)) ||
+        (rx && !mapRing(m_rx, off.rx, XDP_PGOFF_RX_RING, sizeof(struct xdp_desc))) ||
+        (tx && !mapRing(m_tx, off.tx, XDP_PGOFF_TX_RING, sizeof(struct xdp_desc))))
+    {
+        close();
+        return false;
+    }
+
+    if (rx)
+    {
+        unsigned long long *fill = (unsigned long long *)m_fill.m_desc;
+        for (int i = 0; i < YAZXSKRING; ++i)
+            fill[i] = (unsigned long long)i * YAZXSKFRAMESIZE;
+        __sync_synchronize();
+        *m_fill.m_producer = YAZXSKRING;
+    }
+
+    // zero copy if the driver can, else copy mode.
+    struct sockaddr_xdp sxdp;
+    memset(&sxdp, 0, sizeof(struct sockaddr_xdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = ifindex;
+    sxdp.sxdp_queue_id = queue;
+    sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_ZEROCOPY;
+    m_zerocopy = true;
+    if (bind(m_sd, (const struct sockaddr *)&sxdp, sizeof(struct sockaddr_xdp)) < 0)
+    {
+        sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_COPY;
+        m_zerocopy = false;
+        if (bind(m_sd, (const struct sockaddr *)&sxdp, sizeof(struct sockaddr_xdp)) < 0)
+        {
+            std::cerr << "!!couldn't bind AF_XDP socket to queue " << queue << ": " << errno << '/' << strerror(errno) << std::endl;
+            close();
+            return false;
+        }
+    }
+
+    if (verbose)
+        std::cout << "##AF_XDP socket on ifindex " << ifindex << " queue " << queue << (m_zerocopy ? " (zero copy)" : " (copy)") << std::endl;
+    return true;
+}
+
+
+void YazXsk::close()
+{
+    unmapRing(m_fill);
+    unmapRing(m_comp);
+    unmapRing(m_rx);
+    unmapRing(m_tx);
+    if (m_sd >= 0)
+        ::close(m_sd);
+    m_sd = -1;
+    if (m_umem)
+        munmap(m_umem, m_umem_len);
+    m_umem = 0;
+    m_outstanding = 0;
+}
+
+
+bool YazXsk::txPost(unsigned long long addr, int len)
+{
+    unsigned int prod = *m_tx.m_producer;
+    if (prod - *m_tx.m_consumer >= (unsigned int)YAZXSKRING)
+        return false;
+
+    struct xdp_desc *d = (struct xdp_desc *)m_tx.m_desc + (prod & (YAZXSKRING - 1));
+    d->addr = addr;
+    d->len = len;
+    d->options = 0;
+    __sync_synchronize();
+    *m_tx.m_producer = prod + 1;
+    m_outstanding++;
+    return true;
+}
+
+
+bool YazXsk::txKick()
+{
+    if (!(*m_tx.m_flags & XDP_RING_NEED_WAKEUP))
+        return true;
+    if (sendto(m_sd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+        errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+    {
+        std::cerr << "!! error sending probe: " << errno << '/' << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+int YazXsk::txReap()
+{
+    unsigned int prod = *m_comp.m_producer;
+    unsigned int cons = *m_comp.m_consumer;
+    __sync_synchronize();
+    *m_comp.m_consumer = prod;
+    m_outstanding -= (prod - cons);
+    return m_outstanding;
+}
+
+
+int YazXsk::rxPeek(struct xdp_desc *out, int max)
+{
+    unsigned int cons = *m_rx.m_consumer;
+    unsigned int avail = *m_rx.m_producer - cons;
+    __sync_synchronize();
+
+    int n = std::min(int(avail), max);
+    for (int i = 0; i < n; ++i)
+        out[i] = ((struct xdp_desc *)m_rx.m_desc)[(cons + i) & (YAZXSKRING - 1)];
+    return n;
+}
+
+
+void YazXsk::rxRelease(const struct xdp_desc *descs, int n)
+{
+    unsigned int prod = *m_fill.m_producer;
+    unsigned long long *fill = (unsigned long long *)m_fill.m_desc;
+    for (int i = 0; i < n; ++i)
+        fill[(prod + i) & (YAZXSKRING - 1)] = descs[i].addr - descs[i].addr % YAZXSKFRAMESIZE;
+    __sync_synchronize();
+    *m_fill.m_producer = prod + n;
+    *m_rx.m_consumer += n;
+}
+
+
+// the steering program leaves bpf_ktime_get_ns() in the 8 bytes of
+// metadata in front of the packet.  where the metadata didn't make it
+// (no room, or a kernel that doesn't copy it in copy mode) the bytes
+// are left over from an earlier packet, so anything that isn't close
+// to now is ignored and the caller stamps the probe itself.
+long long YazXsk::rxStamp(const struct xdp_desc &d)
+{
+    if (d.addr % YAZXSKFRAMESIZE < sizeof(long long))
+        return 0;
+
+    long long stamp;
+    memcpy(&stamp, m_umem + d.addr - sizeof(long long), sizeof(long long));
+    long long now = now_nsecs();
+    if (stamp > now || stamp < now - YAZXDPSTAMPSLOP)
+        return 0;
+    return stamp;
+}
+
+
+bool YazXskTx::open(int probe_sd, int nframes, int verbose)
+{
+    if (nframes > YAZXSKRING)
+    {
+        std::cerr << "!!streams longer than " << YAZXSKRING << " probes don't fit an AF_XDP ring" << std::endl;
+        return false;
+    }
+    m_nframes = nframes;
+
+    std::string dev;
+    if (!findPath(probe_sd, dev))
+        return false;
+
+    // sending needs no xdp program, only a socket on a queue.
+    if (!m_xsk.open(if_nametoindex(dev.c_str()), 0, false, true, verbose))
+        return false;
+
+    m_paylen = -1;
+    return true;
+}
+
+
+bool YazXskTx::prepStream(int paylen, unsigned int session, int stream, int spacing_ns)
+{
+    // the previous stream's frames have to be back before they can be
+    // rewritten.
+    struct timeval start, now, diff;
+    gettimeofday(&start, 0);
+    while (m_xsk.txReap() > 0)
+    {
+        gettimeofday(&now, 0);
+        timersub(&now, &start, &diff);
+        if (diff.tv_sec * 1000 + diff.tv_usec / 1000 > YAZTXRINGWAIT)
+        {
+            std::cerr << "!!AF_XDP socket didn't finish sending after " << YAZTXRINGWAIT << " milliseconds" << std::endl;
+            return false;
+        }
+        m_xsk.txKick();
+        poll(0, 0, 1);
+    }
+
+    for (int i = 0; i < m_nframes; ++i)
+    {
+        char *data = m_xsk.frame(m_xsk.txFrame(i));
+        if (paylen != m_paylen)
+            m_frame_len = buildFrame(data, paylen);
+        stampFrame(data, session, stream, spacing_ns);
+    }
+    m_paylen = paylen;
+    return true;
+}
+
+
+void YazXskTx::fill(int seq, long long sent)
+{
+    unsigned long long addr = m_xsk.txFrame(seq % m_nframes);
+    seqFrame(m_xsk.frame(addr), seq, sent);
+    m_xsk.txPost(addr, m_frame_len);
+}
+
+
+bool YazXskTx::kick()
+{
+    bool ok = m_xsk.txKick();
+    m_xsk.txReap();
+    return ok;
+}
+
+
+bool YazXdpSteer::attach(int ifindex, unsigned short port, int nqueues, int verbose)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(union bpf_attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(int);
+    attr.value_size = sizeof(int);
+    attr.max_entries = nqueues;
+    m_map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if (m_map_fd < 0)
+    {
+        std::cerr << "!!couldn't create XSKMAP: " << errno << '/' << strerror(errno) << std::endl;
+        return false;
+    }
+
+    // r6 = ctx.  stamp first (adjust_meta moves the packet pointers),
+    // then match the probe and redirect to the socket for this rx queue.
+    std::vector<struct bpf_insn> prog;
+    std::vector<size_t> to_parse, to_pass;
+
+    prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, R6, R1, 0, 0));
+    prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_K, R2, 0, 0, -int(sizeof(long long))));
+    prog.push_back(insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_xdp_adjust_meta));
+    prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, R7, R0, 0, 0));
+    prog.push_back(insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_ktime_get_ns));
+    prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, R8, R0, 0, 0));
+    prog.push_back(insn(BPF_LDX | BPF_MEM | BPF_W, R2, R6, offsetof(struct xdp_md, data), 0));
+    prog.push_back(insn(BPF_LDX | BPF_MEM | BPF_W, R3, R6, offsetof(struct xdp_md, data_end), 0));
+    to_parse.push_back(prog.size());
+    prog.push_back(insn(BPF_JMP | BPF_JNE | BPF_K, R7, 0, 0, 0));
+    prog.push_back(insn(BPF_LDX | BPF_MEM | BPF_W, R1, R6, offsetof(struct xdp_md, data_meta), 0));
+    prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, R4, R1, 0, 0));
+    prog.push_back(insn(BPF_ALU64 | BPF_ADD | BPF_K, R4, 0, 0, sizeof(long long)));
+    to_parse.push_back(prog.size());
+    prog.push_back(insn(BPF_JMP | BPF_JGT | BPF_X, R4, R2, 0, 0));
+    prog.push_back(insn(BPF_STX | BPF_MEM | BPF_DW, R1, R8, 0, 0));
+
+    size_t parse = prog.size();
+    match_probe(prog, R2, R3, port, ETH_HLEN + sizeof(struct ip) + sizeof(struct udphdr), to_pass);
+
+    // redirect, falling back to XDP_PASS if the queue has no socket.
+    prog.push_back(insn(BPF_LDX | BPF_MEM | BPF_W, R2, R6, offsetof(struct xdp_md, rx_queue_index), 0));
+    prog.push_back(insn(BPF_LD | BPF_DW | BPF_IMM, R1, BPF_PSEUDO_MAP_FD, 0, m_map_fd));
+    prog.push_back(insn(0, 0, 0, 0, 0));
+    prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_K, R3, 0, 0, XDP_PASS));
+    prog.push_back(insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map));
+    prog.push_back(insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    size_t pass = prog.size();
+    prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_K, R0, 0, 0, XDP_PASS));
+    prog.push_back(insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    for (size_t i = 0; i < to_parse.size(); ++i)
+        prog[to_parse[i]].off = parse - to_parse[i] - 1;
+    for (size_t i = 0; i < to_pass.size(); ++i)
+        prog[to_pass[i]].off = pass - to_pass[i] - 1;
+
+    m_prog_fd = load_xdp(prog, "probe steering", verbose);
+    if (m_prog_fd >= 0)
+        m_link_fd = link_xdp(m_prog_fd, ifindex, "probe steering", verbose);
+    if (m_link_fd < 0)
+    {
+        detach();
+        return false;
+    }
+    return true;
+}
+
+
+bool YazXdpSteer::add(int queue, int xsk_fd)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(union bpf_attr));
+    attr.map_fd = m_map_fd;
+    attr.key = (unsigned long long)&queue;
+    attr.value = (unsigned long long)&xsk_fd;
+    attr.flags = BPF_ANY;
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+    {
+        std::cerr << "!!couldn't add AF_XDP socket for queue " << queue << " to XSKMAP: " << errno << '/' << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+void YazXdpSteer::detach()
+{
+    if (m_link_fd >= 0)
+        close(m_link_fd);
+    if (m_prog_fd >= 0)
+        close(m_prog_fd);
+    if (m_map_fd >= 0)
+        close(m_map_fd);
+    m_link_fd = m_prog_fd = m_map_fd = -1;
+}
+
+
+#if HAVE_PROBE_TAP
+
+bool YazProbeTap::attach(int ifindex, unsigned short port, bool drop, int verbose)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(union bpf_attr));
+    attr.map_type = BPF_MAP_TYPE_RINGBUF;
+    attr.max_entries = YAZTAPRING;
+    m_map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if (m_map_fd < 0)
+    {
+        std::cerr << "!!couldn't create probe tap ring buffer: " << errno << '/' << strerror(errno) << std::endl;
+        return false;
+    }
+
+    // the consumer position is ours to write; the producer position
+    // and the records (mapped twice over, so none wraps) are read-only.
+    long pgsize = sysconf(_SC_PAGESIZE);
+    void *cons = mmap(0, pgsize, PROT_READ | PROT_WRITE, MAP_SHARED, m_map_fd, 0);
+    void *prod = mmap(0, pgsize + 2 * YAZTAPRING, PROT_READ, MAP_SHARED, m_map_fd, pgsize);
+    if (cons == MAP_FAILED || prod == MAP_FAILED)
+    {
+        std::cerr << "!!couldn't map probe tap ring buffer: " << errno << '/' << strerror(errno) << std::endl;
+        if (cons != MAP_FAILED)
+            munmap(cons, pgsize);
+        detach();
+        return false;
+    }
+    m_consumer = (volatile unsigned long *)cons;
+    m_producer = (volatile unsigned long *)prod;
+
+    // r6 = ctx, r8 = arrival stamp, r9 = packet.  once the probe has
+    // matched, reserve a record, copy the probe header and ttl into it
+    // and submit it.  a full ring leaves the probe to the stack.
+    std::vector<struct bpf_insn> prog;
+    std::vector<size_t> to_pass;
+    int hdrs = ETH_HLEN + sizeof(struct ip) + sizeof(struct udphdr);
+
+    prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, R6, R1, 0, 0));
+    prog.push_back(insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_ktime_get_ns));
+    prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, R8, R0, 0, 0));
+    prog.push_back(insn(BPF_LDX | BPF_MEM | BPF_W, R9, R6, offsetof(struct xdp_md, data), 0));
+    prog.push_back(insn(BPF_LDX | BPF_MEM | BPF_W, R3, R6, offsetof(struct xdp_md, data_end), 0));
+    match_probe(prog, R9, R3, port, hdrs + sizeof(YazPkt), to_pass);
+
+    prog.push_back(insn(BPF_LD | BPF_DW | BPF_IMM, R1, BPF_PSEUDO_MAP_FD, 0, m_map_fd));
+    prog.push_back(insn(0, 0, 0, 0, 0));
+    prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_K, R2, 0, 0, sizeof(YazTapRecord)));
+    prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_K, R3, 0, 0, 0));
+    prog.push_back(insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_ringbuf_reserve));
+    to_pass.push_back(prog.size());
+    prog.push_back(insn(BPF_JMP | BPF_JEQ | BPF_K, R0, 0, 0, 0));
+    prog.push_back(insn(BPF_STX | BPF_MEM | BPF_DW, R0, R8, offsetof(YazTapRecord, m_ktime), 0));
+    for (size_t off = 0; off < sizeof(YazPkt); off += sizeof(int))
+    {
+        prog.push_back(insn(BPF_LDX | BPF_MEM | BPF_W, R1, R9, hdrs + off, 0));
+        prog.push_back(insn(BPF_STX | BPF_MEM | BPF_W, R0, R1, offsetof(YazTapRecord, m_pkt) + off, 0));
+    }
+    prog.push_back(insn(BPF_LDX | BPF_MEM | BPF_B, R1, R9, ETH_HLEN + offsetof(struct ip, ip_ttl), 0));
+    prog.push_back(insn(BPF_STX | BPF_MEM | BPF_W, R0, R1, offsetof(YazTapRecord, m_ttl), 0));
+    prog.push_back(insn(BPF_ST | BPF_MEM | BPF_W, R0, 0, offsetof(YazTapRecord, m_pad), 0));
+    prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_X, R1, R0, 0, 0));
+    prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_K, R2, 0, 0, 0));
+    prog.push_back(insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_ringbuf_submit));
+    prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_K, R0, 0, 0, drop ? XDP_DROP : XDP_PASS));
+    prog.push_back(insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    size_t pass = prog.size();
+    prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_K, R0, 0, 0, XDP_PASS));
+    prog.push_back(insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    for (size_t i = 0; i < to_pass.size(); ++i)
+        prog[to_pass[i]].off = pass - to_pass[i] - 1;
+
+    m_prog_fd = load_xdp(prog, "probe tap", verbose);
+    if (m_prog_fd >= 0)
+        m_link_fd = link_xdp(m_prog_fd, ifindex, "probe tap", verbose);
+    if (m_link_fd < 0)
+    {
+        detach();
+        return false;
+    }
+    return true;
+}
+
+
+void YazProbeTap::detach()
+{
+    long pgsize = sysconf(_SC_PAGESIZE);
+    if (m_consumer)
+        munmap((void *)m_consumer, pgsize);
+    if (m_producer)
+        munmap((void *)m_producer, pgsize + 2 * YAZTAPRING);
+    m_consumer = m_producer = 0;
+    if (m_link_fd >= 0)
+        close(m_link_fd);
+    if (m_prog_fd >= 0)
+        close(m_prog_fd);
+    if (m_map_fd >= 0)
+        close(m_map_fd);
+    m_link_fd = m_prog_fd = m_map_fd = -1;
+}
+
+
+// copy out up to max committed records and hand their space back to
+// the kernel.  each record has an 8 byte header (length with busy and
+// discard bits, page offset) and is padded to 8 bytes.
+int YazProbeTap::read(YazTapRecord *out, int max)
+{
+    long pgsize = sysconf(_SC_PAGESIZE);
+    const char *data = (const char *)m_producer + pgsize;
+    unsigned long cons = *m_consumer;
+    unsigned long prod = *m_producer;
+    __sync_synchronize();
+
+    int n = 0;
+    while (cons < prod && n < max)
+    {
+        const volatile unsigned int *hdr = (const volatile unsigned int *)(data + (cons & (YAZTAPRING - 1)));
+        unsigned int len = *hdr;
+        __sync_synchronize();
+        if (len & BPF_RINGBUF_BUSY_BIT)
+            break;
+
+        bool discard = (len & BPF_RINGBUF_DISCARD_BIT);
+        len &= ~(BPF_RINGBUF_BUSY_BIT | BPF_RINGBUF_DISCARD_BIT);
+        if (!discard && len >= sizeof(YazTapRecord))
+            memcpy(&out[n++], (const char *)hdr + BPF_RINGBUF_HDR_SZ, sizeof(YazTapRecord));
+        cons += (len + BPF_RINGBUF_HDR_SZ + 7) & ~7UL;
+    }
+    __sync_synchronize();
+    *m_consumer = cons;
+    return n;
+}
+
+#endif // HAVE_PROBE_TAP
+
+#endif // HAVE_AF_XDP